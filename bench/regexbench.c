@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libwing/getopt.h>
+#include <libwing/regex.h>
+
+/*Microbenchmarks for regcomp and regexec.
+
+  Output is one record per line, tab-separated, so that runs can be
+    diffed and fed to other tools:
+      #regexbench <format-version>
+      compile <class> <iterations> <ns-per-compile>
+      exec <class> <line-length> <match-permille> <lines> <iterations> <ns-per-line> <MB-per-s> <matches>
+      footprint <private|shared> <patterns> <bytes-per-pattern>
+      cache <cold|warm> <patterns> <ns-per-pattern>
+      iterate <class> <buffer-bytes> <iterations> <ns-per-match> <MB-per-s> <matches>
+      approx <exact|errors> <line-length> <lines> <iterations> <ns-per-line> <MB-per-s> <matches>
+  Fields never contain whitespace.  MB means 2^20 bytes of line text,
+    not counting terminators.
+
+  Generated input lines are lowercase letters and spaces.  Every pattern
+    in the catalogue needs at least one character outside that alphabet,
+    so a line matches exactly when its needle was planted in it.
+*/
+#define FORMAT_VERSION 2
+
+struct bench_pattern
+{
+	const char *name;
+	const char *pattern;
+	int cflags;
+	const char *needle;	/*planted in matching lines*/
+	int at_start;	/*plant needle at start of line instead of middle*/
+};
+
+static const struct bench_pattern catalogue[] =
+{
+	{ "literal",     "NEEDLE",                     REG_BASIC,    "NEEDLE", 0 },
+	{ "alternation", "ALPHA|BRAVO|CHARLIE|NEEDLE", REG_EXTENDED, "NEEDLE", 0 },
+	{ "class",       "[A-Z][0-9][0-9]*[A-Z]",      REG_BASIC,    "X42Y", 0 },
+	{ "counted",     "[0-9]{3}-[0-9]{4}",          REG_EXTENDED, "555-1234", 0 },
+	{ "dotstar",     "NEE.*DLE",                   REG_BASIC,    "NEE  DLE", 0 },
+	{ "prefixed",    "NEED[a-z]*LE",               REG_BASIC,    "NEEDxLE", 0 },
+	{ "backref",     "\\([A-Z][A-Z]*\\)=\\1",      REG_BASIC,    "KEY=KEY", 0 },
+	{ "icase",       "ne_dle",                     REG_ICASE,    "NE_DLE", 0 },
+	{ "anchored",    "^NEEDLE",                    REG_BASIC,    "NEEDLE", 1 },
+	{ "large",       "[0-9]{70}",                  REG_EXTENDED,
+		"0123456789012345678901234567890123456789012345678901234567890123456789", 0 },
+	/*UTF-8 cases; the needles are "n\u00f6dle" and "NE\u20acDLE"*/
+	{ "utf8class",   "n[\xc3\xa4\xc3\xb6\xc3\xbc]dle", REG_UTF8, "n\xc3\xb6" "dle", 0 },
+	{ "utf8dot",     "NE.DLE",                     REG_UTF8,     "NE\xe2\x82\xac" "DLE", 0 },
+};
+#define NPATTERNS (sizeof catalogue / sizeof catalogue[0])
+
+/*For regapprox: a lowercase literal, so its pieces do turn up in the
+  input now and then, planted with two letters missing.
+*/
+static const struct bench_pattern approx_case =
+	{ "approx", "misspelled", REG_BASIC, "mispeled", 0 };
+#define MAX_APPROX_ERRORS 2
+
+static const size_t line_lengths[] = { 16, 80, 512, 4096 };
+#define NLENGTHS (sizeof line_lengths / sizeof line_lengths[0])
+
+/*Fraction of lines that match, in thousandths*/
+static const unsigned match_permille[] = { 0, 10, 500 };
+#define NRATES (sizeof match_permille / sizeof match_permille[0])
+
+static double min_seconds = 0.2;
+static size_t input_size = 1024*1024;
+
+/*Small deterministic generator, so every run sees the same input*/
+static unsigned long rng_state;
+static unsigned long rng(void)
+{
+	rng_state = rng_state * 1103515245UL + 12345UL;
+	return (rng_state >> 16) & 0x7fff;
+}
+
+/*Builds nlines NUL-terminated lines of length len, back to back.
+  Roughly permille/1000 of them have the needle planted.
+  Returns NULL on allocation failure.
+*/
+static char *make_lines(const struct bench_pattern *bp, size_t len, size_t nlines, unsigned permille)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz      ";
+	size_t nlen = strlen(bp->needle);
+	char *buf;
+	size_t i, j;
+
+	if(len < nlen)
+		len = nlen;
+	if((buf = malloc(nlines * (len+1))) == NULL)
+		return NULL;
+
+	rng_state = 1;
+	for(i=0; i<nlines; i++)
+	{
+		char *line = buf + i*(len+1);
+		for(j=0; j<len; j++)
+			line[j] = alphabet[rng() % (sizeof alphabet - 1)];
+		line[len] = '\0';
+		if(rng() % 1000 < permille)
+		{
+			size_t at = bp->at_start ? 0 : rng() % (len - nlen + 1);
+			memcpy(line + at, bp->needle, nlen);
+		}
+	}
+	return buf;
+}
+
+/*Templates for the footprint run, which compiles a large rule set.
+  %d is replaced with the rule number, so every pattern is different
+    but they share bracket expressions the way generated rules do.
+*/
+static const char *rule_templates[] =
+{
+	"rule%d=[0-9]+",
+	"user%d [A-Za-z_][A-Za-z_0-9]*",
+	"^host-%d\\.[a-z]+\\.example$",
+	"id=%d,[0-9a-f]{8}-[0-9a-f]{4}",
+};
+#define NTEMPLATES (sizeof rule_templates / sizeof rule_templates[0])
+
+static unsigned long footprint_patterns = 0;
+static const char *cache_path = NULL;
+
+static double elapsed(clock_t start)
+{
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static int bench_compile(const struct bench_pattern *bp)
+{
+	unsigned long iters = 0;
+	double secs;
+	clock_t start = clock();
+	regex_t re;
+	int ret;
+
+	do
+	{
+		if((ret = regcomp(&re, bp->pattern, bp->cflags | REG_NOSUB)) != 0)
+			return ret;
+		regfree(&re);
+		iters++;
+	}
+	while((secs = elapsed(start)) < min_seconds);
+
+	printf("compile\t%s\t%lu\t%.1f\n", bp->name, iters, secs * 1e9 / iters);
+	return 0;
+}
+
+static int bench_exec(const struct bench_pattern *bp, size_t len, unsigned permille)
+{
+	size_t nlines;
+	char *lines;
+	regex_t re;
+	unsigned long iters = 0;
+	unsigned long matches = 0;
+	double secs;
+	clock_t start;
+	size_t i;
+	int ret;
+
+	if(len < strlen(bp->needle))
+		return 0;	/*needle would not fit; nothing to measure*/
+	nlines = input_size / (len+1);
+	if(nlines == 0)
+		nlines = 1;
+	if((lines = make_lines(bp, len, nlines, permille)) == NULL)
+		return REG_ESPACE;
+	if((ret = regcomp(&re, bp->pattern, bp->cflags | REG_NOSUB)) != 0)
+	{
+		free(lines);
+		return ret;
+	}
+
+	start = clock();
+	do
+	{
+		matches = 0;
+		for(i=0; i<nlines; i++)
+			if(regexec(&re, lines + i*(len+1), 0, NULL, 0) == 0)
+				matches++;
+		iters++;
+	}
+	while((secs = elapsed(start)) < min_seconds);
+
+	printf("exec\t%s\t%lu\t%u\t%lu\t%lu\t%.1f\t%.2f\t%lu\n",
+		bp->name, (unsigned long)len, permille, (unsigned long)nlines, iters,
+		secs * 1e9 / ((double)iters * nlines),
+		(double)iters * nlines * len / secs / (1024*1024),
+		matches);
+
+	regfree(&re);
+	free(lines);
+	return 0;
+}
+
+/*Finds every match in one big buffer with regiter_next, the way grep -o
+  and friends do, instead of a regexec per line.
+*/
+static int bench_iterate(const struct bench_pattern *bp)
+{
+	const size_t len = 80;
+	size_t nlines = input_size / (len+1);
+	size_t size;
+	char *buf;
+	regex_t re;
+	regiter_t it;
+	regmatch_t m;
+	unsigned long iters = 0;
+	unsigned long matches = 0;
+	double secs;
+	clock_t start;
+	size_t i;
+	int ret;
+
+	if(len < strlen(bp->needle))
+		return 0;
+	if(nlines == 0)
+		nlines = 1;
+	if((buf = make_lines(bp, len, nlines, 500)) == NULL)
+		return REG_ESPACE;
+	size = nlines * (len+1);
+	for(i=len; i<size; i+=len+1)
+		buf[i] = '\n';
+	if((ret = regcomp(&re, bp->pattern, bp->cflags | REG_NOSUB)) != 0)
+	{
+		free(buf);
+		return ret;
+	}
+
+	start = clock();
+	do
+	{
+		matches = 0;
+		regiter_init(&it, &re, buf, size, 0);
+		while((ret = regiter_next(&it, 1, &m)) == 0)
+			matches++;
+		if(ret != REG_NOMATCH)
+			break;
+		ret = 0;
+		iters++;
+	}
+	while((secs = elapsed(start)) < min_seconds);
+
+	if(ret == 0)
+		printf("iterate\t%s\t%lu\t%lu\t%.1f\t%.2f\t%lu\n",
+			bp->name, (unsigned long)size, iters,
+			matches ? secs * 1e9 / ((double)iters * matches) : 0.0,
+			(double)iters * size / secs / (1024*1024),
+			matches);
+
+	regfree(&re);
+	free(buf);
+	return ret;
+}
+
+/*Searches lines for approx_case with regapprox_exec, allowing 0 to
+  MAX_APPROX_ERRORS errors, and with plain regexec for comparison.
+*/
+static int bench_approx(size_t len)
+{
+	const struct bench_pattern *bp = &approx_case;
+	size_t nlines = input_size / (len+1);
+	char *lines;
+	regex_t re;
+	regapprox_t *ra = NULL;
+	unsigned long iters;
+	unsigned long matches;
+	double secs;
+	clock_t start;
+	char kname[16];
+	size_t i;
+	int k;
+	int ret;
+
+	if(nlines == 0)
+		nlines = 1;
+	if((lines = make_lines(bp, len, nlines, 10)) == NULL)
+		return REG_ESPACE;
+	if((ret = regcomp(&re, bp->pattern, bp->cflags | REG_NOSUB)) != 0)
+	{
+		free(lines);
+		return ret;
+	}
+
+	for(k=-1; ret == 0 && k<=MAX_APPROX_ERRORS; k++)
+	{
+		if(k >= 0 && (ret = regapprox_comp(&ra, &re, k)) != 0)
+			break;
+		iters = 0;
+		start = clock();
+		do
+		{
+			matches = 0;
+			for(i=0; i<nlines; i++)
+			{
+				const char *line = lines + i*(len+1);
+				if(k < 0 ? regexec(&re, line, 0, NULL, 0) == 0 : regapprox_exec(ra, line, len, NULL, NULL) == 0)
+					matches++;
+			}
+			iters++;
+		}
+		while((secs = elapsed(start)) < min_seconds);
+
+		if(k < 0)
+			strcpy(kname, "exact");
+		else
+			sprintf(kname, "%d", k);
+		printf("approx\t%s\t%lu\t%lu\t%lu\t%.1f\t%.2f\t%lu\n",
+			kname, (unsigned long)len, (unsigned long)nlines, iters,
+			secs * 1e9 / ((double)iters * nlines),
+			(double)iters * nlines * len / secs / (1024*1024),
+			matches);
+		if(ra != NULL)
+			regapprox_free(ra);
+		ra = NULL;
+	}
+
+	regfree(&re);
+	free(lines);
+	return ret;
+}
+
+/*Compiles footprint_patterns rules and reports the average memory held
+  per compiled pattern, as counted by reginfo().
+*/
+static int bench_footprint(int share)
+{
+	regex_t *res;
+	char pattern[128];
+	unsigned long i, n;
+	double total = 0;
+	struct reginfo info;
+	int ret = 0;
+
+	if((res = malloc(footprint_patterns * sizeof *res)) == NULL)
+		return REG_ESPACE;
+	for(n=0; n<footprint_patterns; n++)
+	{
+		sprintf(pattern, rule_templates[n % NTEMPLATES], (int)n);
+		if((ret = regcomp(&res[n], pattern, REG_EXTENDED | REG_NOSUB | (share ? REG_SHARE : 0))) != 0)
+			break;
+	}
+	/*Measure once everything is compiled, so sharing is at its peak*/
+	for(i=0; i<n; i++)
+	{
+		reginfo(&res[i], &info);
+		total += info.footprint;
+	}
+	if(ret == 0)
+		printf("footprint\t%s\t%lu\t%.1f\n", share ? "shared" : "private", n, total / n);
+	for(i=0; i<n; i++)
+		regfree(&res[i]);
+	free(res);
+	return ret;
+}
+
+/*Compiles the footprint rule set through a regcache twice: the first
+    pass starts from no file and compiles everything, the second loads
+    everything from the file the first one wrote.
+  Times cover opening the cache and getting every pattern, not writing
+    the file out.
+*/
+static int bench_cache(void)
+{
+	static const char *pass_names[] = { "cold", "warm" };
+	regex_t *res;
+	regcache_t *rc;
+	char pattern[128];
+	unsigned long i, n;
+	int pass;
+	double secs;
+	clock_t start;
+	int ret = 0;
+
+	if((res = malloc(footprint_patterns * sizeof *res)) == NULL)
+		return REG_ESPACE;
+	remove(cache_path);
+	for(pass=0; ret == 0 && pass<2; pass++)
+	{
+		start = clock();
+		if((rc = regcache_open(cache_path)) == NULL)
+		{
+			ret = REG_ESPACE;
+			break;
+		}
+		for(n=0; n<footprint_patterns; n++)
+		{
+			sprintf(pattern, rule_templates[n % NTEMPLATES], (int)n);
+			if((ret = regcache_comp(rc, &res[n], pattern, REG_EXTENDED | REG_NOSUB)) != 0)
+				break;
+		}
+		secs = elapsed(start);
+		if(ret == 0)
+			printf("cache\t%s\t%lu\t%.1f\n", pass_names[pass], n, secs * 1e9 / n);
+		for(i=0; i<n; i++)
+			regfree(&res[i]);
+		if(regcache_close(rc) != 0)
+			perror(cache_path);
+	}
+	free(res);
+	return ret;
+}
+
+static void usage_and_die(const char *myname)
+{
+	fprintf(stderr, "Usage: %s [-t min-seconds] [-s input-bytes] [-m patterns [-c cachefile]] [class ...]\n", myname);
+	exit(EXIT_FAILURE);
+}
+
+/*Returns nonzero if the named class was asked for (or none were)*/
+static int wanted(const char *name, int argc, char **argv)
+{
+	int i;
+	if(optind == argc)
+		return 1;
+	for(i=optind; i<argc; i++)
+		if(strcmp(argv[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	size_t p, l, r;
+	char *endptr;
+	int ret;
+
+	while((opt = getopt(argc, argv, "t:s:m:c:")) != -1)
+	{
+		switch(opt)
+		{
+		case 't':
+			min_seconds = strtod(optarg, &endptr);
+			if(min_seconds <= 0 || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad time '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 's':
+			input_size = strtoul(optarg, &endptr, 10);
+			if(input_size == 0 || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad size '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'm':
+			footprint_patterns = strtoul(optarg, &endptr, 10);
+			if(footprint_patterns == 0 || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad pattern count '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'c':
+			cache_path = optarg;
+		break;
+		case '?':
+			usage_and_die(argv[0]);
+		/*not reached*/
+		break;
+		default:
+			fprintf(stderr, "%s: Internal error: getopt returned unexpected value '%c'\n", argv[0], opt);
+			exit(EXIT_FAILURE);
+		/*not reached*/
+		}
+	}
+
+	printf("#regexbench\t%d\n", FORMAT_VERSION);
+	if(footprint_patterns > 0)
+	{
+		/*-m asks for the footprint run only*/
+		if((ret = bench_footprint(0)) == 0)
+			ret = bench_footprint(1);
+		if(ret == 0 && cache_path != NULL)
+			ret = bench_cache();
+		if(ret != 0)
+		{
+			char errbuf[256];
+			regerror(ret, NULL, errbuf, sizeof errbuf);
+			fprintf(stderr, "%s: footprint: %s\n", argv[0], errbuf);
+			return EXIT_FAILURE;
+		}
+		return 0;
+	}
+	for(p=0; p<NPATTERNS; p++)
+	{
+		const struct bench_pattern *bp = &catalogue[p];
+		if(!wanted(bp->name, argc, argv))
+			continue;
+
+		ret = bench_compile(bp);
+		for(l=0; ret == 0 && l<NLENGTHS; l++)
+			for(r=0; ret == 0 && r<NRATES; r++)
+				ret = bench_exec(bp, line_lengths[l], match_permille[r]);
+		if(ret == 0)
+			ret = bench_iterate(bp);
+		if(ret != 0)
+		{
+			char errbuf[256];
+			regerror(ret, NULL, errbuf, sizeof errbuf);
+			fprintf(stderr, "%s: %s: %s\n", argv[0], bp->name, errbuf);
+			return EXIT_FAILURE;
+		}
+		fflush(stdout);
+	}
+	if(wanted(approx_case.name, argc, argv))
+	{
+		ret = 0;
+		for(l=0; ret == 0 && l<NLENGTHS; l++)
+			ret = bench_approx(line_lengths[l]);
+		if(ret != 0)
+		{
+			char errbuf[256];
+			regerror(ret, NULL, errbuf, sizeof errbuf);
+			fprintf(stderr, "%s: %s: %s\n", argv[0], approx_case.name, errbuf);
+			return EXIT_FAILURE;
+		}
+	}
+
+	return 0;
+}
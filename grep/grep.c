@@ -1,105 +1,2449 @@
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <libwing/filecache.h>
 #include <libwing/getopt.h>
 #include <libwing/libwing.h>
 #include <libwing/regex.h>
+#include <libwing/windex.h>
 
 regex_t grep_regex;
+/*The same pattern compiled with REG_NEWLINE, so it can be run over a
+  whole buffer of lines and still only match within one*/
+regex_t buffer_regex;
+int buffer_search = 0;
+regcache_t *grep_cache;
+regapprox_t *grep_approx;
+const char *cache_file;
+/*-T: files the index rules out aren't opened at all*/
+windex_t *grep_index;
+const char *index_file;
+/*-S: what searching each file printed, for files that haven't changed*/
+filecache_t *grep_results;
+const char *results_file;
+uint64_t results_limit = (uint64_t)64 << 20;
+char *results_query;	/*everything besides the file that makes a difference to that*/
 unsigned long matched;
+int jobs = 0;
+int recursive = 0;
+int disk_order = 0;	/*-O: search files in the order they lie on disk*/
+int with_filenames = 0;
 int match_type = 0;
+int utf8 = 0;
+int only_matching = 0;
+int whole = 0;	/*REG_WORD for -w, REG_LINE for -x*/
+int invert = 0;
+int line_numbers = 0;
+int byte_offsets = 0;
+unsigned long before_context = 0;
+unsigned long after_context = 0;
+int context = 0;	/*-A, -B or -C, even 0, which still separates groups*/
+/*Some file has printed lines with context, so the next file's first
+  group needs a separator*/
+int context_shown = 0;
+int max_errors = -1;
+
+/*What to do with files that have a nul in them*/
+#define BINARY_REPORT	0	/*say whether they match*/
+#define BINARY_TEXT	1	/*-a: print matching lines anyway*/
+#define BINARY_SKIP	2	/*-I: take them not to match*/
+int binary_files = BINARY_REPORT;
+
+/*What to say about each file*/
+#define REPORT_LINES	0
+#define REPORT_COUNT	1	/*-c*/
+#define REPORT_MATCHING	2	/*-l*/
+#define REPORT_NONMATCHING	3	/*-L*/
+#define REPORT_NOTHING	4	/*-q*/
+int report = REPORT_LINES;
+/*A file is only searched until this many lines have matched, since no
+  more could change the output*/
+unsigned long max_count = ULONG_MAX;
+/*-M: lines longer than this are shown by an excerpt, not printed whole,
+  and files that have to be read are read into a buffer no bigger than
+  about twice this, searching longer lines in windows as they go by.
+  0 for no limit.
+*/
+size_t long_lines = 0;
+/*How much each window over a long line overlaps the last: enough for
+  any match to be whole in one of them, and a byte to look back at,
+  unless matches can be longer than half the limit.
+*/
+size_t window_overlap = 0;
+#define EXCERPT_SIZE 80
+
+/*With -M, lines -B might want that had to be dropped from the buffer
+  before it, with what's shown of them: the whole line, or the start of
+  one too long to print.
+*/
+struct held_line
+{
+	uintmax_t offset;	/*in the file*/
+	uintmax_t number;	/*for -n*/
+	uintmax_t len;	/*of the whole line, not counting its newline*/
+	char *text;
+	size_t size;	/*allocated for text*/
+};
+
+/*A ring of the last of them, up to before_context*/
+struct held
+{
+	struct held_line *lines;
+	size_t size;
+	size_t first;	/*the oldest*/
+	size_t n;
+};
+
+/*Where the output for a file goes.  Files searched by worker threads
+  keep theirs in memory until the files before them are done.
+*/
+struct output
+{
+	const char *name;	/*of the file, or (standard input)*/
+	FILE *f;	/*NULL to keep it in buf*/
+	char *buf;
+	size_t len;
+	size_t size;
+	unsigned long matched;	/*lines that matched*/
+	int binary;	/*the file has nuls; lines aren't printed*/
+	int nomem;
+
+	/*Where the lines being searched are in the file.  Newlines are
+	  only counted up to each line that's printed, so -n costs nothing
+	  where nothing matches.
+	*/
+	const char *start;	/*of the buffer being searched*/
+	uintmax_t offset;	/*in the file, of start*/
+	const char *counted;	/*newlines are counted up to here*/
+	uintmax_t line;	/*lines before counted*/
+
+	/*For context.  Earlier lines are found by looking back from a match
+	  in the buffer, not kept as they go by; the buffer just mustn't drop
+	  them too soon.
+	*/
+	const char *floor;	/*where earlier lines kept in the buffer start, if before start*/
+	const char *end;	/*of the buffer being searched*/
+	int crlf;
+	int shown_any;	/*lines have been printed*/
+	uintmax_t shown;	/*offset in the file just past the last of them*/
+	unsigned long after;	/*context lines still to print after it*/
+	int separate;	/*put a separator before the first group anyway*/
+	struct held *held;	/*lines before floor, if the buffer drops any*/
+
+	struct output *tee;	/*gets a copy of what's written to f, if not NULL*/
+	size_t limit;	/*buf can't grow past this, if it isn't 0*/
+};
+
+void put(struct output *out, const char *p, size_t n)
+{
+	size_t size;
+	char *t;
+
+	if(n == 0)
+		return;
+	if(out->f != NULL)
+	{
+		fwrite(p, 1, n, out->f);
+		if(out->tee != NULL)
+			put(out->tee, p, n);
+		return;
+	}
+	if(out->nomem)
+		return;
+	if(n > out->size - out->len)
+	{
+		if(out->limit != 0 && n > out->limit - out->len)
+		{
+			out->nomem=1;
+			return;
+		}
+		size=out->size ? out->size : 4096;
+		while(size - out->len < n)
+			size*=2;
+		if((t=realloc(out->buf, size)) == NULL)
+		{
+			out->nomem=1;
+			return;
+		}
+		out->buf=t;
+		out->size=size;
+	}
+	memcpy(out->buf+out->len, p, n);
+	out->len+=n;
+}
+
+/*Counts the newlines in the n bytes at p a word at a time*/
+uintmax_t count_newlines(const char *p, size_t n)
+{
+	const uint64_t ones=0x0101010101010101u;
+	const uint64_t high=0x8080808080808080u;
+	uintmax_t count=0;
+	uint64_t w, x;
+
+	for(; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+		count+=(*p++ == '\n');
+	for(; n >= 8; n-=8, p+=8)
+	{
+		memcpy(&w, p, 8);
+		w^=ones*'\n';
+		/*High bit set in each byte of w that's now 0*/
+		x=~(((w & ~high) + ~high) | w) & high;
+		count+=(uintmax_t)(((x >> 7) * ones) >> 56);
+	}
+	for(; n > 0; n--)
+		count+=(*p++ == '\n');
+	return count;
+}
+
+void put_number(struct output *out, uintmax_t n)
+{
+	char digits[24];
+	char *p=digits+sizeof digits;
+
+	do
+		*--p=(char)('0' + n%10);
+	while((n/=10) > 0);
+	put(out, p, (size_t)(digits+sizeof digits - p));
+}
+
+/*Where at is in the file.  Kept context lines come before start, and
+  the wraparound works out for them.
+*/
+uintmax_t file_offset(const struct output *out, const char *at)
+{
+	return out->offset + (uintmax_t)(at - out->start);
+}
+
+/*Number of the line at at is in*/
+uintmax_t line_number(struct output *out, const char *at)
+{
+	if(at < out->counted)
+		return out->line + 1 - count_newlines(at, (size_t)(out->counted - at));
+	out->line+=count_newlines(out->counted, (size_t)(at - out->counted));
+	out->counted=at;
+	return out->line + 1;
+}
+
+/*Starts a line of output, for a line with the given number and offset
+  in the file, which needn't be in the buffer.
+*/
+void put_prefix_of(struct output *out, uintmax_t number, uintmax_t offset, char sep)
+{
+	if(with_filenames)
+	{
+		put(out, out->name, strlen(out->name));
+		put(out, &sep, 1);
+	}
+	if(line_numbers)
+	{
+		put_number(out, number);
+		put(out, &sep, 1);
+	}
+	if(byte_offsets)
+	{
+		put_number(out, offset);
+		put(out, &sep, 1);
+	}
+}
+
+/*Starts a line of output, for the line or -o match at at.
+  sep is ':' after a matching line's name and numbers, or '-' after a
+  context line's.
+*/
+void put_prefix(struct output *out, const char *at, char sep)
+{
+	put_prefix_of(out, line_numbers ? line_number(out, at) : 0, file_offset(out, at), sep);
+}
+
+/*Catches a nul past the part of the file looked at up front, in a line
+  about to be printed, which makes the file binary after all.
+  Returns nonzero if the file is binary.
+*/
+int binary_line(const char *line, size_t len, struct output *out)
+{
+	if(!out->binary && binary_files != BINARY_TEXT && report == REPORT_LINES && memchr(line, '\0', len) != NULL)
+		out->binary=1;
+	return out->binary;
+}
+
+/*Lines aren't nul-terminated; they're matched where they lie*/
+int line_matches(const char *line, size_t len)
+{
+	regmatch_t m;
+
+	if(grep_approx != NULL)
+		return regapprox_exec(grep_approx, line, len, NULL, NULL) == 0;
+	m.rm_so=0;
+	m.rm_eo=(regoff_t)len;
+	return regexec(&grep_regex, line, 1, &m, REG_STARTEND) == 0;
+}
+
+/*Writes each non-empty match in the len bytes at line to out, one per
+  line.
+  Returns nonzero if there was any match at all, even an empty one.
+*/
+int print_matches(const char *line, size_t len, struct output *out)
+{
+	regiter_t it;
+	regmatch_t m;
+	int found=0;
+
+	if(grep_approx != NULL)
+	{
+		size_t pos=0;
+		while(pos <= len && regapprox_exec(grep_approx, line+pos, len-pos, &m, NULL) == 0)
+		{
+			if(!found && binary_line(line, len, out))
+				return 1;
+			found=1;
+			if(m.rm_eo > m.rm_so)
+			{
+				put_prefix(out, line+pos+m.rm_so, ':');
+				put(out, line+pos+m.rm_so, (size_t)(m.rm_eo-m.rm_so));
+				put(out, "\n", 1);
+				pos+=m.rm_eo;
+			}
+			else
+				pos+=m.rm_eo+1;
+		}
+		return found;
+	}
+
+	regiter_init(&it, &grep_regex, line, len, 0);
+	while(regiter_next(&it, 1, &m) == 0)
+	{
+		if(!found && binary_line(line, len, out))
+			return 1;
+		found=1;
+		if(m.rm_eo > m.rm_so)
+		{
+			put_prefix(out, line+m.rm_so, ':');
+			put(out, line+m.rm_so, (size_t)(m.rm_eo-m.rm_so));
+			put(out, "\n", 1);
+		}
+	}
+	return found;
+}
+
+/*Text-mode streams on Win32 turn \r\n into \n, but a mapped file hasn't
+  been through one, so its lines still end in \r\n.
+*/
+#ifdef _WIN32
+#define MAPPED_CRLF 1
+#else
+#define MAPPED_CRLF 0
+#endif
+
+/*Size of the reads for files that can't be mapped.  The buffer grows
+  past this only for longer lines.
+*/
+#define BLOCK_SIZE (64*1024)
+
+/*The earliest line that's still in the buffer and hasn't been printed*/
+const char *unshown(const struct output *out)
+{
+	const char *floor=(out->floor != NULL) ? out->floor : out->start;
+	uintmax_t at=file_offset(out, floor);
+
+	if(!out->shown_any || out->shown < at)
+		return floor;
+	return floor + (out->shown - at);
+}
+
+/*Finds the first match in the len bytes at p, searching from from; any
+  bytes before that are only there to be looked back at.  bol and eol
+  say whether p and p+len are where the line starts and ends, which they
+  needn't be for a window over a long line.
+  Returns nonzero, with the match in *m, if there is one.
+*/
+int first_match(const char *p, size_t from, size_t len, int bol, int eol, regmatch_t *m)
+{
+	regiter_t it;
+
+	if(grep_approx != NULL)
+	{
+		if(regapprox_exec(grep_approx, p+from, len-from, m, NULL) != 0)
+			return 0;
+		m->rm_so+=(regoff_t)from;
+		m->rm_eo+=(regoff_t)from;
+		return 1;
+	}
+	regiter_init(&it, &grep_regex, p, len, (bol ? 0 : REG_NOTBOL) | (eol ? 0 : REG_NOTEOL));
+	regiter_seek(&it, from);
+	return regiter_next(&it, 1, m) == 0;
+}
+
+/*Shows a line of len bytes that's too long to print: its length, where
+  in it the first match starts if found, and up to elen bytes of excerpt
+  from there, or from the start of the line.
+*/
+void put_long(struct output *out, uintmax_t len, int found, uintmax_t at, const char *excerpt, size_t elen)
+{
+	if(elen > EXCERPT_SIZE)
+		elen=EXCERPT_SIZE;
+	if(elen > len - at)
+		elen=(size_t)(len - at);
+	put(out, "[long line: ", 12);
+	put_number(out, len);
+	put(out, " bytes", 6);
+	if(found)
+	{
+		put(out, ", match at ", 11);
+		put_number(out, at);
+	}
+	put(out, "] ", 2);
+	put(out, excerpt, elen);
+	put(out, "\n", 1);
+}
+
+/*Prints the context line at p, which ends at a newline or at end.
+  Returns the start of the next line.
+*/
+const char *print_context(const char *p, const char *end, struct output *out)
+{
+	const char *nl=memchr(p, '\n', (size_t)(end-p));
+	size_t n=(size_t)(((nl != NULL) ? nl : end) - p);
+
+	if(out->crlf && nl != NULL && n > 0 && p[n-1] == '\r')
+		n--;
+	put_prefix(out, p, '-');
+	if(long_lines != 0 && n > long_lines)
+	{
+		put_long(out, n, 0, 0, p, EXCERPT_SIZE);
+		return (nl != NULL) ? nl+1 : end;
+	}
+	put(out, p, n);
+	if(nl == NULL)
+		return end;
+	put(out, "\n", 1);
+	return nl+1;
+}
+
+/*Prints what's left of the context after the last line printed, up to
+  limit.
+*/
+void print_after(const char *limit, struct output *out)
+{
+	const char *p;
+
+	if(out->after == 0 || out->binary)
+		return;
+	for(p=unshown(out); out->after > 0 && p < limit; out->after--)
+		p=print_context(p, limit, out);
+	out->shown=file_offset(out, p);
+}
+
+/*Adds a line leaving the buffer to out->held, dropping the oldest if
+  it's full.  The line is len bytes; text is the first tlen of them.
+*/
+void hold_line(struct output *out, uintmax_t offset, uintmax_t number, uintmax_t len, const char *text, size_t tlen)
+{
+	struct held *h=out->held;
+	struct held_line *hl;
+	char *t;
+	size_t i;
+
+	if(h->n == h->size && h->size < before_context)
+	{
+		/*Grow the full ring, oldest first again*/
+		size_t size=2*h->size + 8;
+		struct held_line *lines;
+		if(size > before_context)
+			size=before_context;
+		if((lines=calloc(size, sizeof *lines)) == NULL)
+		{
+			out->nomem=1;
+			return;
+		}
+		for(i=0; i < h->n; i++)
+			lines[i]=h->lines[(h->first + i) % h->size];
+		free(h->lines);
+		h->lines=lines;
+		h->size=size;
+		h->first=0;
+	}
+	hl=&h->lines[(h->first + h->n) % h->size];
+	if(tlen > hl->size)
+	{
+		if((t=realloc(hl->text, tlen)) == NULL)
+		{
+			out->nomem=1;
+			return;
+		}
+		hl->text=t;
+		hl->size=tlen;
+	}
+	if(tlen > 0)
+		memcpy(hl->text, text, tlen);
+	hl->offset=offset;
+	hl->number=number;
+	hl->len=len;
+	if(h->n < h->size)
+		h->n++;
+	else
+		h->first=(h->first + 1) % h->size;
+}
+
+/*Holds the whole lines from p to end, which are leaving the buffer*/
+void hold_lines(const char *p, const char *end, struct output *out)
+{
+	uintmax_t number=line_numbers ? line_number(out, p) : 0;
+	const char *nl;
+	size_t n;
+
+	for(; p < end; p=nl+1, number++)
+	{
+		nl=memchr(p, '\n', (size_t)(end-p));
+		n=(size_t)(nl-p);
+		if(out->crlf && n > 0 && p[n-1] == '\r')
+			n--;
+		hold_line(out, file_offset(out, p), number, n, p, (n > long_lines && n > EXCERPT_SIZE) ? EXCERPT_SIZE : n);
+	}
+}
+
+void free_held(struct held *h)
+{
+	size_t i;
+
+	for(i=0; i < h->size; i++)
+		free(h->lines[i].text);
+	free(h->lines);
+}
+
+/*The held line k lines before the buffer*/
+const struct held_line *held_line(const struct held *h, size_t k)
+{
+	return &h->lines[(h->first + h->n-1 - k) % h->size];
+}
+
+/*Prints a held line as print_context would have*/
+void print_held(const struct held_line *hl, struct output *out)
+{
+	put_prefix_of(out, hl->number, hl->offset, '-');
+	if(long_lines != 0 && hl->len > long_lines)
+	{
+		put_long(out, hl->len, 0, 0, hl->text, EXCERPT_SIZE);
+		return;
+	}
+	put(out, hl->text, (size_t)hl->len);
+	put(out, "\n", 1);
+}
+
+/*Prints the context before the line at line, and a separator first if
+  it doesn't carry straight on from the last group.
+*/
+void print_before(const char *line, struct output *out)
+{
+	const char *lo;
+	const char *p=line;
+	unsigned long n;
+	size_t k=0;	/*held lines to print*/
+	uintmax_t from;
+
+	print_after(line, out);
+	lo=unshown(out);
+	for(n=0; n < before_context && p > lo; n++)
+	{
+		p--;
+		while(p > lo && p[-1] != '\n')
+			p--;
+	}
+	/*Short of lines in the buffer, there may be more before it*/
+	if(out->held != NULL)
+		while(n + k < before_context && k < out->held->n
+			&& (!out->shown_any || held_line(out->held, k)->offset >= out->shown))
+			k++;
+	from=(k > 0) ? held_line(out->held, k-1)->offset : file_offset(out, p);
+	if(out->shown_any ? out->shown != from : out->separate)
+		put(out, "--\n", 3);
+	while(k > 0)
+		print_held(held_line(out->held, --k), out);
+	while(p < line)
+		p=print_context(p, line, out);
+}
+
+/*Prints a selected line that's too long to print whole, as put_long
+  shows it.  It starts at line, though only the lines before it need
+  still be in the buffer, and the next line starts at next in the file.
+*/
+void print_long(const char *line, uintmax_t len, uintmax_t next, int found, uintmax_t at,
+	const char *excerpt, size_t elen, struct output *out)
+{
+	if(context)
+		print_before(line, out);
+	put_prefix(out, line, ':');
+	put_long(out, len, found, at, excerpt, elen);
+	if(context)
+	{
+		out->shown_any=1;
+		out->shown=next;
+		out->after=after_context;
+	}
+}
+
+/*Prints a line known to match, len bytes not counting its newline*/
+void print_line(const char *line, size_t len, int newline, struct output *out)
+{
+	out->matched++;
+	if(report != REPORT_LINES || binary_line(line, len, out))
+		return;
+	if(long_lines != 0 && len > long_lines)
+	{
+		const char *end=line+len;
+		regmatch_t m;
+		int found=!invert && first_match(line, 0, len, 1, 1, &m);
+		size_t at=found ? (size_t)m.rm_so : 0;
+		if(newline)
+			end=(const char *)memchr(end, '\n', (size_t)(out->end - end)) + 1;
+		print_long(line, len, file_offset(out, end), found, at, line+at, EXCERPT_SIZE, out);
+		return;
+	}
+	if(only_matching)
+	{
+		print_matches(line, len, out);
+		return;
+	}
+	if(context)
+		print_before(line, out);
+	put_prefix(out, line, ':');
+	put(out, line, len);
+	if(newline)
+		put(out, "\n", 1);
+	if(context)
+	{
+		const char *end=line+len;
+		if(newline)
+			end=(const char *)memchr(end, '\n', (size_t)(out->end - end)) + 1;
+		out->shown_any=1;
+		out->shown=file_offset(out, end);
+		out->after=after_context;
+	}
+}
+
+/*Greps one line, len bytes not counting its newline*/
+void grep_line(const char *line, size_t len, int newline, struct output *out)
+{
+	if(only_matching && !invert && report == REPORT_LINES && !out->binary && (long_lines == 0 || len <= long_lines))
+	{
+		if(print_matches(line, len, out))
+			out->matched++;
+	}
+	else if(line_matches(line, len) != invert)
+		print_line(line, len, newline, out);
+}
+
+/*Nonzero once nothing more in the file could change the output*/
+int file_done(const struct output *out)
+{
+	return out->matched >= max_count || (out->binary && out->matched > 0);
+}
+
+/*Prints the lines from p to end, which don't match, for -v.
+  Unless each line needs something put before it or might stop the
+  search, they're counted and written out all at once.
+*/
+void print_range(const char *p, const char *end, int crlf, struct output *out)
+{
+	const char *nl;
+	size_t n;
+
+	if(p == end)
+		return;
+	if(!with_filenames && !line_numbers && !byte_offsets && !context && !only_matching && !crlf && max_count == ULONG_MAX && long_lines == 0)
+	{
+		out->matched+=count_newlines(p, (size_t)(end-p)) + (end[-1] != '\n');
+		if(report == REPORT_LINES && !binary_line(p, (size_t)(end-p), out))
+			put(out, p, (size_t)(end-p));
+		return;
+	}
+	while(p < end && !file_done(out))
+	{
+		nl=memchr(p, '\n', (size_t)(end-p));
+		n=(size_t)(((nl != NULL) ? nl : end) - p);
+		if(crlf && nl != NULL && n > 0 && p[n-1] == '\r')
+			n--;
+		print_line(p, n, nl != NULL, out);
+		p=(nl != NULL) ? nl+1 : end;
+	}
+}
+
+/*Like grep_lines, but runs buffer_regex over all the lines at once and
+  only looks for the edges of the lines it matches in.  When matches
+  are rare that's much cheaper than a regexec per line.
+*/
+size_t search_lines(const char *buf, size_t len, int final, int crlf, struct output *out)
+{
+	regiter_t it;
+	regmatch_t m;
+	size_t limit=len;
+	const char *start;
+	const char *nl;
+	const char *from=buf;	/*for -v, the end of the last matching line*/
+	size_t n;
+
+	/*Only whole lines, unless this is the end*/
+	if(!final)
+	{
+		while(limit > 0 && buf[limit-1] != '\n')
+			limit--;
+	}
+	/*An empty file is mapped at NULL, which the matcher can't take*/
+	if(limit == 0)
+		return 0;
+
+	regiter_init(&it, &buffer_regex, buf, limit, 0);
+	while(regiter_next(&it, 1, &m) == 0)
+	{
+		start=buf+m.rm_so;
+		/*An empty match after the last newline isn't in a line*/
+		if((size_t)m.rm_so == limit && (limit == 0 || buf[limit-1] == '\n'))
+			break;
+		while(start > buf && start[-1] != '\n')
+			start--;
+		nl=memchr(buf+m.rm_so, '\n', limit-(size_t)m.rm_so);
+		n=(size_t)(((nl != NULL) ? nl : buf+limit) - start);
+		if(crlf && nl != NULL && n > 0 && start[n-1] == '\r')
+			n--;
+		/*REG_NEWLINE keeps . and [^...] off newlines, but not sets like
+		  [[:space:]], so a match that takes one in only says the line
+		  is worth a look*/
+		if(nl != NULL && buf+m.rm_eo > nl && !line_matches(start, n))
+		{
+			regiter_seek(&it, (size_t)(nl+1-buf));
+			continue;
+		}
+		if(invert)
+		{
+			/*Everything since the last matching line is selected*/
+			print_range(from, start, crlf, out);
+			from=(nl != NULL) ? nl+1 : buf+limit;
+		}
+		else
+			print_line(start, n, nl != NULL, out);
+		if(nl == NULL || file_done(out))
+			break;
+		regiter_seek(&it, (size_t)(nl+1-buf));
+	}
+	if(invert && !file_done(out))
+		print_range(from, buf+limit, crlf, out);
+	return limit;
+}
+
+/*Like grep_lines, but runs the pattern over each line in turn*/
+size_t each_line(const char *buf, size_t len, int final, int crlf, struct output *out)
+{
+	const char *p=buf;
+	const char *end=buf+len;
+	const char *nl;
+
+	while((nl=memchr(p, '\n', (size_t)(end-p))) != NULL)
+	{
+		size_t n=(size_t)(nl-p);
+		if(crlf && n > 0 && p[n-1] == '\r')
+			n--;
+		grep_line(p, n, 1, out);
+		p=nl+1;
+		if(file_done(out))
+			return len;
+	}
+	if(final && p < end)
+	{
+		grep_line(p, (size_t)(end-p), 0, out);
+		p=end;
+	}
+	return (size_t)(p-buf);
+}
+
+/*Greps the whole lines in the len bytes at buf, in place.  If final is
+  nonzero, trailing bytes with no newline are a line too.
+  Returns the number of bytes used up; the rest are the start of a line.
+  out->line and out->offset are moved on past them, ready for the rest.
+*/
+size_t grep_lines(const char *buf, size_t len, int final, int crlf, struct output *out)
+{
+	size_t used;
+
+	out->start=buf;
+	out->counted=buf;
+	out->end=buf+len;
+	out->crlf=crlf;
+	if(buffer_search)
+		used=search_lines(buf, len, final, crlf, out);
+	else
+		used=each_line(buf, len, final, crlf, out);
+	if(context)
+		print_after(buf+used, out);
+	if(line_numbers && !final && !file_done(out))
+		out->line+=count_newlines(out->counted, (size_t)(buf+used - out->counted));
+	out->offset+=used;
+	out->start=out->counted=buf+used;
+	return used;
+}
+
+/*How much of the len bytes of lines searched at the start of buf can
+  be dropped from the buffer, keeping the ones -B might want.
+*/
+size_t keep_before(const char *buf, size_t len, struct output *out)
+{
+	const char *lo=unshown(out);
+	const char *p=buf+len;
+	const char *from;
+	unsigned long n;
+
+	for(n=0; n < before_context && p > lo; n++)
+	{
+		p--;
+		while(p > lo && p[-1] != '\n')
+			p--;
+	}
+	/*With -M, only what context fits in a long line's worth is kept,
+	  and the rest held, after any held lines it still follows on from*/
+	from=p;
+	while(long_lines != 0 && (size_t)(buf+len - p) > long_lines)
+		p=(const char *)memchr(p, '\n', (size_t)(buf+len - p)) + 1;
+	if(out->held != NULL)
+	{
+		if(from > buf)
+			out->held->n=0;
+		hold_lines(from, p, out);
+	}
+	return (size_t)(p-buf);
+}
+
+/*Looks for a nul near the start of a file, as most binary files have.
+  Ones further in are caught by binary_line if they're in a match.
+  Binary files only matter if lines are to be printed, or for -I.
+*/
+void check_binary(const char *buf, size_t len, struct output *out)
+{
+	if(binary_files == BINARY_TEXT || (binary_files == BINARY_REPORT && report != REPORT_LINES))
+		return;
+	if(len > 0 && memchr(buf, '\0', (len < BLOCK_SIZE) ? len : BLOCK_SIZE) != NULL)
+		out->binary=1;
+}
+
+/*Writes what goes after the matching lines of a file, or instead of them*/
+void finish_file(struct output *out)
+{
+	char count[32];
+
+	switch(report)
+	{
+	case REPORT_LINES:
+		if(out->binary && out->matched > 0 && binary_files == BINARY_REPORT)
+		{
+			put(out, "Binary file ", 12);
+			put(out, out->name, strlen(out->name));
+			put(out, " matches\n", 9);
+		}
+	break;
+	case REPORT_COUNT:
+		if(with_filenames)
+		{
+			put(out, out->name, strlen(out->name));
+			put(out, ":", 1);
+		}
+		sprintf(count, "%lu\n", out->matched);
+		put(out, count, strlen(count));
+	break;
+	case REPORT_MATCHING:
+	case REPORT_NONMATCHING:
+		if((out->matched > 0) == (report == REPORT_MATCHING))
+		{
+			put(out, out->name, strlen(out->name));
+			put(out, "\n", 1);
+		}
+	break;
+	}
+}
+
+int check_output(struct output *out)
+{
+	if(out->nomem)
+	{
+		errno=ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/*Small files are searched a batch at a time, so that the system can
+  be asked to open and read them all at once
+*/
+#define BATCH_FILES 32
+#define BATCH_FILE_SIZE (64*1024)
+
+/*-O chooses among this many files at a time, whose output is held back
+  until it's their turn; the rest of each file being searched in a batch
+  is asked for this far ahead
+*/
+#define ORDER_WINDOW 1024
+#define PREFETCH_SIZE (1024*1024)
+
+struct job;
+
+/*Workers call back into these*/
+int search_file(const char *file, struct output *out);
+void search_batch(struct job **batch, size_t n, struct wing_batch *reader);
+
+/*Work for the threads started by -j, in the order its output is to
+  appear: files, pieces of one big mapped file, or, with -r,
+  directories, which add jobs for what's in them.
+*/
+struct job
+{
+	char *name;	/*NULL for a piece of a file*/
+	int isdir;
+	const char *data;	/*the piece: whole lines*/
+	size_t len;
+	uintmax_t offset;	/*of the piece in the file*/
+	uintmax_t newlines;	/*in the piece, once counted is set, for -n*/
+	int counted;
+	int numbered;	/*out.line is the number of lines before the piece*/
+	struct output out;
+	int err;	/*from search_file, or reading the directory*/
+	int taken;	/*by a worker; only kept track of for -O*/
+	int done;
+	struct wing_place place;	/*for -O*/
+};
+
+/*Jobs can be added while the pool runs, so they're allocated one by
+  one and stay put while the array of them moves.
+*/
+struct pool
+{
+	struct job **jobs;
+	size_t njobs;
+	size_t alloc;
+	size_t next;	/*first job no worker has taken; -O takes some after it*/
+	size_t written;	/*jobs whose output has been written*/
+	size_t window;	/*how far workers can get ahead of the writing*/
+	size_t nthreads;	/*workers sharing the jobs*/
+	int busy;	/*jobs being done, which might add more*/
+	int quit;	/*-q found a match; nothing more to do*/
+	struct wing_mutex *lock;	/*NULL when run_inline does the jobs*/
+	struct wing_cond *changed;	/*broadcast whenever next, written, busy, quit, numbered or a done changes*/
+	struct output *dest;
+	size_t numbered;	/*pieces whose out.line is known*/
+	uintmax_t lines;	/*in those pieces*/
+	int failed;	/*a file or directory couldn't be read*/
+	int err;	/*first error searching a piece*/
+};
+
+void lock_pool(struct pool *pool)
+{
+	if(pool->lock != NULL)
+		wing_mutex_lock(pool->lock);
+}
+
+void unlock_pool(struct pool *pool)
+{
+	if(pool->lock != NULL)
+		wing_mutex_unlock(pool->lock);
+}
+
+void free_job(struct job *j)
+{
+	free(j->name);
+	free(j->out.buf);
+	free(j);
+}
+
+/*Returns a new job for the named file or directory, or for a piece of
+  a file if name is NULL; or NULL if out of memory.
+*/
+struct job *new_job(const char *name, size_t namelen, int isdir)
+{
+	struct job *j=calloc(1, sizeof *j);
+
+	if(j == NULL)
+		return NULL;
+	j->isdir=isdir;
+	if(name == NULL)
+		return j;
+	if((j->name=malloc(namelen+1)) == NULL)
+	{
+		free(j);
+		return NULL;
+	}
+	memcpy(j->name, name, namelen);
+	j->name[namelen]='\0';
+	return j;
+}
+
+/*Adds n jobs to the end of pool.  The caller holds the lock.
+  Returns 0, or -1 if out of memory, in which case the jobs are not
+  added.
+*/
+int append_jobs(struct pool *pool, struct job **batch, size_t n)
+{
+	if(n > pool->alloc - pool->njobs)
+	{
+		size_t alloc=pool->alloc ? pool->alloc : 64;
+		struct job **t;
+		while(n > alloc - pool->njobs)
+			alloc*=2;
+		if((t=realloc(pool->jobs, alloc * sizeof *t)) == NULL)
+			return -1;
+		pool->jobs=t;
+		pool->alloc=alloc;
+	}
+	memcpy(pool->jobs + pool->njobs, batch, n * sizeof *batch);
+	pool->njobs+=n;
+	return 0;
+}
+
+/*wing_glob_foreach callback that adds a job to the pool, for a file or,
+  with -r, a directory
+*/
+int add_job(const char *file, void *vpool)
+{
+	struct wing_dir *d;
+	struct job *j;
+	int isdir=0;
+
+	if(recursive && (d=wing_opendir(file)) != NULL)
+	{
+		wing_closedir(d);
+		isdir=1;
+	}
+	if((j=new_job(file, strlen(file), isdir)) == NULL)
+		return 1;
+	/*One that can't be placed goes first, to fail at once*/
+	if(disk_order && !isdir)
+		wing_place(file, &j->place);
+	if(append_jobs(vpool, &j, 1) != 0)
+	{
+		free_job(j);
+		return 1;
+	}
+	return 0;
+}
+
+/*Makes a job for everything to search in the directory j.
+  They're all added at once, so other threads can go on with them as
+  soon as possible but don't fight over the lock for each one.
+*/
+void walk_dir(struct pool *pool, struct job *j)
+{
+	struct wing_dir *d;
+	struct job **batch=NULL;
+	size_t n=0;
+	size_t alloc=0;
+	size_t dirlen=strlen(j->name);
+	const char *name;
+	int type;
+	int ret;
+
+	if((d=wing_opendir(j->name)) == NULL)
+	{
+		j->err=errno;
+		return;
+	}
+	/*Don't double up the separator after "dir/"*/
+	if(dirlen > 0 && j->name[dirlen-1] == '/')
+		dirlen--;
+	while((ret=wing_readdir(d, &name, &type)) > 0)
+	{
+		size_t len=strlen(name);
+		struct job *nj;
+
+		if(type == WING_DT_OTHER)
+			continue;
+		if(n == alloc)
+		{
+			struct job **t;
+			alloc=alloc ? 2*alloc : 64;
+			if((t=realloc(batch, alloc * sizeof *t)) == NULL)
+				break;
+			batch=t;
+		}
+		if((nj=new_job(NULL, 0, type == WING_DT_DIR)) == NULL || (nj->name=malloc(dirlen+1+len+1)) == NULL)
+		{
+			free(nj);
+			break;
+		}
+		memcpy(nj->name, j->name, dirlen);
+		nj->name[dirlen]='/';
+		memcpy(nj->name+dirlen+1, name, len+1);
+		if(disk_order && !nj->isdir)
+			wing_place(nj->name, &nj->place);
+		batch[n++]=nj;
+	}
+	if(ret < 0)
+		j->err=errno;
+	else if(ret > 0)
+		j->err=ENOMEM;
+	wing_closedir(d);
+
+	lock_pool(pool);
+	if(n > 0 && append_jobs(pool, batch, n) != 0)
+	{
+		while(n > 0)
+			free_job(batch[--n]);
+		j->err=ENOMEM;
+	}
+	unlock_pool(pool);
+	free(batch);
+}
+
+/*Works out how many lines come before the piece j, for -n.  Each
+  piece's newlines are counted by the worker that searches it, so they
+  get counted in parallel; then it waits for the pieces before it.
+*/
+void number_piece(struct pool *pool, struct job *j)
+{
+	uintmax_t n=count_newlines(j->data, j->len);
+	struct job *k;
+
+	lock_pool(pool);
+	j->newlines=n;
+	j->counted=1;
+	while(pool->numbered < pool->njobs && (k=pool->jobs[pool->numbered])->counted)
+	{
+		k->out.line=pool->lines;
+		k->numbered=1;
+		pool->lines+=k->newlines;
+		pool->numbered++;
+	}
+	if(pool->lock != NULL)
+	{
+		wing_cond_broadcast(pool->changed);
+		while(!j->numbered)
+			wing_cond_wait(pool->changed, pool->lock);
+	}
+	unlock_pool(pool);
+}
+
+void do_job(struct pool *pool, struct job *j)
+{
+	if(j->isdir)
+		walk_dir(pool, j);
+	else if(j->name != NULL)
+	{
+		j->out.name=j->name;
+		j->err=search_file(j->name, &j->out);
+	}
+	else
+	{
+		j->out.name=pool->dest->name;
+		j->out.offset=j->offset;
+		if(line_numbers)
+			number_piece(pool, j);
+		grep_lines(j->data, j->len, 1, MAPPED_CRLF, &j->out);
+		j->err=(check_output(&j->out) == 0) ? 0 : errno;
+	}
+}
+
+/*Writes out a job's results, and frees it*/
+void write_job(struct pool *pool, struct job *j)
+{
+	/*Once a piece of a file turns out to be binary, the rest of it
+	  doesn't get printed either*/
+	if(!pool->dest->binary)
+	{
+		/*Workers can't tell if groups of context came before*/
+		if(j->out.shown_any)
+		{
+			if(context_shown)
+				put(pool->dest, "--\n", 3);
+			context_shown=1;
+		}
+		put(pool->dest, j->out.buf, j->out.len);
+		pool->dest->matched+=j->out.matched;
+		if(j->name == NULL)
+			pool->dest->binary=j->out.binary;
+	}
+	if(j->err != 0 && j->name == NULL)
+	{
+		if(pool->err == 0)
+			pool->err=j->err;
+	}
+	else if(j->err != 0)
+	{
+		fprintf(stderr, "%s: %s\n", j->name, strerror(j->err));
+		pool->failed=1;
+	}
+	free_job(j);
+}
+
+/*Whether j comes before k on disk*/
+int placed_before(const struct job *j, const struct job *k)
+{
+	if(j->place.device != k->place.device)
+		return j->place.device < k->place.device;
+	if(j->place.exact != k->place.exact)
+		return j->place.exact < k->place.exact;
+	return j->place.address < k->place.address;
+}
+
+/*For -O: takes the first directory or piece of a file not yet taken
+  before limit, on its own, since directories add the files there are
+  to choose from; or else the max files not yet taken that come first
+  on disk, in that order.
+*/
+size_t take_placed(struct pool *pool, struct job **batch, size_t max, size_t limit)
+{
+	size_t n=0;
+	size_t i, k;
+	struct job *j;
+
+	if(limit > pool->njobs)
+		limit=pool->njobs;
+	for(i=pool->next; i < limit; i++)
+	{
+		j=pool->jobs[i];
+		if(j->taken)
+			continue;
+		if(j->isdir || j->name == NULL)
+		{
+			batch[0]=j;
+			n=1;
+			break;
+		}
+		if(n == max && !placed_before(j, batch[n-1]))
+			continue;
+		/*Insert it in order, dropping the last if there's no room*/
+		k=(n < max) ? n++ : n-1;
+		for(; k > 0 && placed_before(j, batch[k-1]); k--)
+			batch[k]=batch[k-1];
+		batch[k]=j;
+	}
+	for(i=0; i < n; i++)
+		batch[i]->taken=1;
+	while(pool->next < pool->njobs && pool->jobs[pool->next]->taken)
+		pool->next++;
+	return n;
+}
+
+/*Takes the jobs from pool->next on that can be done together: a
+  directory or piece of a file on its own, or up to max files, no more
+  than their share of those waiting.  The caller holds the lock, if
+  there is one.
+  Returns how many were put in batch.
+*/
+size_t take_jobs(struct pool *pool, struct job **batch, size_t max, size_t limit)
+{
+	size_t n=0;
+	size_t share=(pool->njobs - pool->next) / (pool->nthreads ? pool->nthreads : 1);
+	struct job *j;
+
+	if(share < max)
+		max=share ? share : 1;
+	if(disk_order)
+		return take_placed(pool, batch, max, limit);
+	while(n < max && pool->next < limit && pool->next < pool->njobs)
+	{
+		j=pool->jobs[pool->next];
+		if(j->isdir || j->name == NULL)
+		{
+			if(n == 0)
+			{
+				batch[n++]=j;
+				pool->next++;
+			}
+			break;
+		}
+		batch[n++]=j;
+		pool->next++;
+	}
+	return n;
+}
+
+void do_jobs(struct pool *pool, struct job **batch, size_t n, struct wing_batch *reader)
+{
+	if(reader != NULL && !batch[0]->isdir && batch[0]->name != NULL)
+		search_batch(batch, n, reader);
+	else
+		do_job(pool, batch[0]);
+}
+
+void worker(void *vpool)
+{
+	struct pool *pool=vpool;
+	struct wing_batch *reader=wing_batch_new(BATCH_FILES, BATCH_FILE_SIZE);
+	struct job *batch[BATCH_FILES];
+	size_t n, i;
+
+	wing_mutex_lock(pool->lock);
+	for(;;)
+	{
+		/*Wait for something to do.  Don't get too far ahead of the
+		  writer, since the output is kept in memory.
+		*/
+		while(!pool->quit && ((pool->next >= pool->njobs && pool->busy > 0) ||
+			(pool->next < pool->njobs && pool->next >= pool->written + pool->window)))
+			wing_cond_wait(pool->changed, pool->lock);
+		if(pool->next >= pool->njobs || pool->quit)
+			break;
+		n=take_jobs(pool, batch, (reader != NULL) ? BATCH_FILES : 1, pool->written + pool->window);
+		pool->busy++;
+		wing_mutex_unlock(pool->lock);
+
+		do_jobs(pool, batch, n, reader);
+
+		wing_mutex_lock(pool->lock);
+		for(i=0; i < n; i++)
+		{
+			batch[i]->done=1;
+			/*Whatever order the files are in, -q can stop at any match*/
+			if(report == REPORT_NOTHING && batch[i]->out.matched > 0)
+				pool->quit=1;
+		}
+		pool->busy--;
+		wing_cond_broadcast(pool->changed);
+	}
+	wing_mutex_unlock(pool->lock);
+	wing_batch_free(reader);
+}
+
+/*Does the jobs in pool, and any they add, on this thread*/
+void run_inline(struct pool *pool)
+{
+	struct wing_batch *reader=wing_batch_new(BATCH_FILES, BATCH_FILE_SIZE);
+	struct job *batch[BATCH_FILES];
+	size_t n, i;
+
+	pool->nthreads=1;
+	pool->window=disk_order ? ORDER_WINDOW : BATCH_FILES;
+	while(pool->next < pool->njobs && !pool->quit)
+	{
+		n=take_jobs(pool, batch, (reader != NULL) ? BATCH_FILES : 1, pool->written + pool->window);
+		do_jobs(pool, batch, n, reader);
+		for(i=0; i < n; i++)
+		{
+			batch[i]->done=1;
+			if(report == REPORT_NOTHING && batch[i]->out.matched > 0)
+				pool->quit=1;
+		}
+		/*With -O, the jobs done needn't be the next to write*/
+		while(pool->written < pool->njobs && pool->jobs[pool->written]->done)
+		{
+			write_job(pool, pool->jobs[pool->written]);
+			pool->jobs[pool->written++]=NULL;
+		}
+	}
+	wing_batch_free(reader);
+}
+
+/*Does the jobs in pool with nthreads workers, writing each job's output
+  to pool->dest in turn as soon as it and the ones before it are done.
+  Returns -1 if no workers could be started, which leaves the pool
+  untouched; otherwise returns 0.  Files that couldn't be searched are
+  reported and set pool->failed; errors in pieces of a file are left
+  in pool->err.
+*/
+int run_pool(struct pool *pool, int nthreads)
+{
+	struct wing_thread **threads;
+	struct job *j;
+	int started=0;
+	size_t i;
+	int t;
+
+	if(pool->njobs == 0)
+		return 0;
+	if(!recursive && (size_t)nthreads > pool->njobs)
+		nthreads=(int)pool->njobs;
+	if((threads=malloc(nthreads * sizeof *threads)) == NULL)
+		return -1;
+	if((pool->lock=wing_mutex_new()) == NULL || (pool->changed=wing_cond_new()) == NULL)
+	{
+		if(pool->lock != NULL)
+			wing_mutex_free(pool->lock);
+		pool->lock=NULL;
+		free(threads);
+		return -1;
+	}
+	pool->nthreads=(size_t)nthreads;
+	pool->window=4*(size_t)nthreads;
+	/*Files need room for a batch each as well; pieces of one file have
+	  more output each, and don't come in batches*/
+	if(pool->jobs[0]->name != NULL)
+		pool->window+=BATCH_FILES*(size_t)nthreads;
+	if(disk_order && pool->jobs[0]->name != NULL && pool->window < ORDER_WINDOW)
+		pool->window=ORDER_WINDOW;
+	for(t=0; t < nthreads; t++)
+		if((threads[started]=wing_thread_start(worker, pool)) != NULL)
+			started++;
+	if(started == 0)
+	{
+		wing_cond_free(pool->changed);
+		wing_mutex_free(pool->lock);
+		pool->lock=NULL;
+		free(threads);
+		return -1;
+	}
+
+	for(i=0; ; i++)
+	{
+		wing_mutex_lock(pool->lock);
+		while(!pool->quit && (i < pool->njobs ? !pool->jobs[i]->done : pool->busy > 0))
+			wing_cond_wait(pool->changed, pool->lock);
+		if(i >= pool->njobs || pool->quit)
+		{
+			wing_mutex_unlock(pool->lock);
+			break;
+		}
+		j=pool->jobs[i];
+		wing_mutex_unlock(pool->lock);
+
+		write_job(pool, j);
+
+		wing_mutex_lock(pool->lock);
+		pool->jobs[i]=NULL;
+		pool->written++;
+		wing_cond_broadcast(pool->changed);
+		wing_mutex_unlock(pool->lock);
+	}
+
+	for(t=0; t < started; t++)
+		wing_thread_join(threads[t]);
+	wing_cond_free(pool->changed);
+	wing_mutex_free(pool->lock);
+	pool->lock=NULL;
+	free(threads);
+	return 0;
+}
+
+/*Frees whatever jobs are left in pool, and the pool*/
+void free_pool(struct pool *pool)
+{
+	size_t i;
+	for(i=0; i < pool->njobs; i++)
+		if(pool->jobs[i] != NULL)
+			free_job(pool->jobs[i]);
+	free(pool->jobs);
+}
+
+/*Pieces of big files are about this size; they end at a newline*/
+#define CHUNK_SIZE (8*1024*1024)
+
+/*Searches a big mapped file in pieces, with jobs threads.
+  Returns 0, or -1 with errno set.
+*/
+int grep_chunks(const char *data, size_t len, struct output *out)
+{
+	struct pool pool={0};
+	const char *nl;
+	size_t pos=0;
+	size_t end;
+	struct job *j;
+
+	pool.dest=out;
+	while(pos < len)
+	{
+		end=len;
+		if(len - pos > CHUNK_SIZE && (nl=memchr(data+pos+CHUNK_SIZE-1, '\n', len-pos-CHUNK_SIZE+1)) != NULL)
+			end=(size_t)(nl+1-data);
+		if((j=new_job(NULL, 0, 0)) == NULL || append_jobs(&pool, &j, 1) != 0)
+		{
+			free(j);
+			break;
+		}
+		j->data=data+pos;
+		j->len=end-pos;
+		j->offset=pos;
+		pos=end;
+	}
+	if(pos < len || run_pool(&pool, jobs) != 0)
+	{
+		/*Not enough memory or threads; one thread needs no jobs*/
+		free_pool(&pool);
+		grep_lines(data, len, 1, MAPPED_CRLF, out);
+		return check_output(out);
+	}
+	free_pool(&pool);
+	if(pool.err != 0)
+	{
+		errno=pool.err;
+		return -1;
+	}
+	return check_output(out);
+}
+
+/*Standard input, when it can't be mapped, is read and the output for
+  it written by threads of their own, so that waiting on a slow pipe at
+  either end overlaps with searching.
+  The reader fills a ring of blocks ahead of the search, which copies
+  them into its line buffer as it would have read them.  Output builds
+  up in memory and goes to the writer through another ring, whose
+  buffers come back to be used again.
+*/
+#define RING_SIZE 8
+
+struct ring_buf
+{
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct stream
+{
+	FILE *in;
+	FILE *dest;
+	struct ring_buf blocks[RING_SIZE];
+	size_t filled;	/*blocks read in*/
+	size_t taken;	/*blocks the search is done with*/
+	size_t pos;	/*how far the search is into the next one*/
+	int reading;	/*the reader is waiting on the input*/
+	int eof;	/*no more blocks will be filled*/
+	int err;	/*errno from a read error*/
+	struct ring_buf outs[RING_SIZE];
+	size_t queued;	/*output buffers passed to the writer*/
+	size_t written;
+	int stop;	/*the search is over; read no more, and write what's queued*/
+	struct wing_mutex *lock;
+	struct wing_cond *changed;	/*broadcast whenever filled, taken, eof, queued, written or stop changes*/
+	struct wing_thread *reader;
+	struct wing_thread *writer;
+};
+
+void stream_reader(void *vs)
+{
+	struct stream *s=vs;
+	struct ring_buf *b;
+	size_t n;
+	int err;
+
+	wing_mutex_lock(s->lock);
+	while(!s->eof)
+	{
+		while(s->filled - s->taken == RING_SIZE && !s->stop)
+			wing_cond_wait(s->changed, s->lock);
+		if(s->stop)
+			break;
+		b=&s->blocks[s->filled % RING_SIZE];
+		s->reading=1;
+		wing_mutex_unlock(s->lock);
+		/*A block is passed on with what's come so far, not when full*/
+		err=wing_read(s->in, b->data, b->size, &n);
+		wing_mutex_lock(s->lock);
+		s->reading=0;
+		b->len=n;
+		if(n > 0)
+			s->filled++;
+		else
+		{
+			if(err != 0)
+				s->err=errno;
+			s->eof=1;
+		}
+		wing_cond_broadcast(s->changed);
+	}
+	wing_mutex_unlock(s->lock);
+}
+
+void stream_writer(void *vs)
+{
+	struct stream *s=vs;
+	struct ring_buf *b;
+
+	wing_mutex_lock(s->lock);
+	for(;;)
+	{
+		if(s->written == s->queued && !s->stop)
+		{
+			/*Caught up; what's written goes out before waiting for more*/
+			wing_mutex_unlock(s->lock);
+			fflush(s->dest);
+			wing_mutex_lock(s->lock);
+		}
+		while(s->written == s->queued && !s->stop)
+			wing_cond_wait(s->changed, s->lock);
+		if(s->written == s->queued)
+			break;
+		b=&s->outs[s->written % RING_SIZE];
+		wing_mutex_unlock(s->lock);
+		fwrite(b->data, 1, b->len, s->dest);
+		wing_mutex_lock(s->lock);
+		s->written++;
+		wing_cond_broadcast(s->changed);
+	}
+	wing_mutex_unlock(s->lock);
+}
+
+void free_stream(struct stream *s)
+{
+	int i;
+
+	if(s->changed != NULL)
+		wing_cond_free(s->changed);
+	if(s->lock != NULL)
+		wing_mutex_free(s->lock);
+	for(i=0; i < RING_SIZE; i++)
+		free(s->outs[i].data);
+	free(s->blocks[0].data);
+	free(s);
+}
+
+/*Starts the threads for reading in and writing to dest.
+  Returns NULL if they can't be had; nothing has been read then.
+*/
+struct stream *start_stream(FILE *in, FILE *dest)
+{
+	struct stream *s=calloc(1, sizeof *s);
+	char *data;
+	int i;
+
+	if(s == NULL)
+		return NULL;
+	s->in=in;
+	s->dest=dest;
+	if((data=malloc(RING_SIZE*BLOCK_SIZE)) == NULL)
+	{
+		free(s);
+		return NULL;
+	}
+	for(i=0; i < RING_SIZE; i++)
+	{
+		s->blocks[i].data=data + i*BLOCK_SIZE;
+		s->blocks[i].size=BLOCK_SIZE;
+	}
+	if((s->lock=wing_mutex_new()) == NULL || (s->changed=wing_cond_new()) == NULL ||
+		(s->writer=wing_thread_start(stream_writer, s)) == NULL)
+	{
+		free_stream(s);
+		return NULL;
+	}
+	/*The writer first, since once the reader starts the input is its*/
+	if((s->reader=wing_thread_start(stream_reader, s)) == NULL)
+	{
+		wing_mutex_lock(s->lock);
+		s->stop=1;
+		wing_cond_broadcast(s->changed);
+		wing_mutex_unlock(s->lock);
+		wing_thread_join(s->writer);
+		free_stream(s);
+		return NULL;
+	}
+	return s;
+}
+
+/*Copies up to n bytes of input to dst, waiting for the reader only if
+  there's nothing ready.
+  Returns 0 at the end of the input or on a read error.
+*/
+size_t stream_read(struct stream *s, char *dst, size_t n)
+{
+	struct ring_buf *b;
+	size_t got=0;
+	size_t len;
+
+	wing_mutex_lock(s->lock);
+	while(s->filled == s->taken && !s->eof)
+		wing_cond_wait(s->changed, s->lock);
+	while(got < n && s->taken < s->filled)
+	{
+		b=&s->blocks[s->taken % RING_SIZE];
+		len=b->len - s->pos;
+		if(len > n - got)
+			len=n - got;
+		wing_mutex_unlock(s->lock);
+		memcpy(dst+got, b->data + s->pos, len);
+		got+=len;
+		s->pos+=len;
+		wing_mutex_lock(s->lock);
+		if(s->pos == b->len)
+		{
+			s->pos=0;
+			s->taken++;
+			wing_cond_broadcast(s->changed);
+		}
+	}
+	wing_mutex_unlock(s->lock);
+	return got;
+}
+
+/*Passes the output built up in out to the writer, and takes back an
+  empty buffer*/
+void stream_flush(struct stream *s, struct output *out)
+{
+	struct ring_buf *b;
+	struct ring_buf t;
+
+	if(out->len == 0)
+		return;
+	wing_mutex_lock(s->lock);
+	while(s->queued - s->written == RING_SIZE)
+		wing_cond_wait(s->changed, s->lock);
+	b=&s->outs[s->queued % RING_SIZE];
+	wing_mutex_unlock(s->lock);
+	t=*b;
+	b->data=out->buf;
+	b->len=out->len;
+	b->size=out->size;
+	out->buf=t.data;
+	out->len=0;
+	out->size=t.size;
+	wing_mutex_lock(s->lock);
+	s->queued++;
+	wing_cond_broadcast(s->changed);
+	wing_mutex_unlock(s->lock);
+}
+
+/*Writes out the rest of the output, and puts out back as it was.
+  A reader still waiting for input that no longer matters is
+  left to it, and its stream is never freed; only standard input is
+  streamed, so nothing else will read or close it, and grep is about
+  to exit.
+  Returns 0, or -1 with errno set if there was a read error.
+*/
+int end_stream(struct stream *s, struct output *out)
+{
+	int reading;
+	int err;
+
+	stream_flush(s, out);
+	free(out->buf);
+	out->buf=NULL;
+	out->size=0;
+	out->f=s->dest;
+
+	wing_mutex_lock(s->lock);
+	s->stop=1;
+	wing_cond_broadcast(s->changed);
+	reading=s->reading;
+	err=s->err;
+	wing_mutex_unlock(s->lock);
+	wing_thread_join(s->writer);
+	if(reading)
+		return 0;
+	wing_thread_join(s->reader);
+	free_stream(s);
+	if(err != 0)
+	{
+		errno=err;
+		return -1;
+	}
+	return 0;
+}
+
+/*Input read ahead of a buffer too small for reads of a good size, as
+  stdio would, and the errno from a read error*/
+struct readahead
+{
+	char *data;	/*BLOCK_SIZE bytes, or NULL to read straight in*/
+	size_t pos;
+	size_t len;
+	int err;
+};
+
+/*Reads up to n bytes of in, through s if it's being streamed, or ra.
+  Takes what input there is without waiting for all n, so lines from a
+  slow pipe are searched as they come.
+  Returns 0 at the end of the input, or on a read error, whose errno is
+  left in ra->err unless it's s's to report.
+*/
+size_t read_input(FILE *in, struct stream *s, char *dst, size_t n, struct readahead *ra)
+{
+	size_t got;
+
+	if(s != NULL)
+		return stream_read(s, dst, n);
+	if(ra->data == NULL)
+	{
+		if(wing_read(in, dst, n, &got) != 0)
+			ra->err=errno;
+		return got;
+	}
+	if(ra->pos == ra->len)
+	{
+		ra->pos=ra->len=0;
+		if(wing_read(in, ra->data, BLOCK_SIZE, &ra->len) != 0)
+			ra->err=errno;
+	}
+	got=(n < ra->len - ra->pos) ? n : ra->len - ra->pos;
+	memcpy(dst, ra->data + ra->pos, got);
+	ra->pos+=got;
+	return got;
+}
+
+/*Greps a line too long for the buffer, with -M.  Its first len bytes
+  are at line, with room for size.  The rest is read into that room a
+  window at a time, each keeping the end of the last, so the line is
+  never held whole.
+  Leaves what was read past the line at line, and returns how much.
+  Sets *eof if the input ran out.
+*/
+size_t grep_long_line(FILE *in, struct stream *s, struct readahead *ra, char *line, size_t len, size_t size, int *eof, struct output *out)
+{
+	char head[EXCERPT_SIZE];	/*the start of the line, for -v and context*/
+	char excerpt[EXCERPT_SIZE];	/*from the first match*/
+	size_t hlen=0;
+	size_t elen=0;
+	uintmax_t offset;	/*of the line in the file*/
+	uintmax_t number;
+	uintmax_t before=0;	/*bytes of the line before the window*/
+	uintmax_t at=0;
+	uintmax_t next;
+	size_t keep=0;	/*bytes at the start of the window kept from the last*/
+	size_t end;
+	size_t n;
+	size_t got;
+	int found=0;
+	int nul=0;
+	int check_nul=(binary_files != BINARY_TEXT && report == REPORT_LINES);
+	const char *nl;
+	regmatch_t m;
+
+	out->start=out->counted=line;
+	offset=out->offset;
+	number=line_number(out, line);
+	/*The lines kept for -B before it can't stay in the buffer*/
+	if(out->held != NULL && out->floor < line)
+	{
+		hold_lines(out->floor, line, out);
+		out->floor=line;
+	}
+	*eof=0;
+	for(;;)
+	{
+		nl=memchr(line+keep, '\n', len-keep);
+		end=(nl != NULL) ? (size_t)(nl-line) : len;
+		/*Small windows each have only part of the head*/
+		if(hlen < EXCERPT_SIZE && before + end > hlen)
+		{
+			n=((before + end < EXCERPT_SIZE) ? (size_t)(before + end) : EXCERPT_SIZE) - hlen;
+			memcpy(head+hlen, line + (size_t)(hlen - before), n);
+			hlen+=n;
+		}
+		if(found)
+		{
+			/*Just finishing the excerpt and finding the end*/
+			n=(end < EXCERPT_SIZE - elen) ? end : EXCERPT_SIZE - elen;
+			memcpy(excerpt+elen, line, n);
+			elen+=n;
+		}
+		else if(first_match(line, (keep > 0), end, before == 0, nl != NULL || *eof, &m))
+		{
+			found=1;
+			at=before + (uintmax_t)m.rm_so;
+			elen=end - (size_t)m.rm_so;
+			if(elen > EXCERPT_SIZE)
+				elen=EXCERPT_SIZE;
+			memcpy(excerpt, line+m.rm_so, elen);
+		}
+		if(check_nul && !nul)
+			nul=(memchr(line+keep, '\0', end-keep) != NULL);
+		if(nl != NULL || *eof)
+			break;
+
+		/*Once there's a match, only the end of the line matters*/
+		keep=found ? 0 : (window_overlap < end) ? window_overlap : end;
+		before+=end-keep;
+		memmove(line, line+end-keep, keep);
+		len=keep;
+		got=read_input(in, s, line+len, size-len, ra);
+		if(got == 0)
+			*eof=1;
+		len+=got;
+	}
+
+	next=file_offset(out, line) + before + end + (nl != NULL);
+	if(found != invert)
+	{
+		out->matched++;
+		if(nul)
+			out->binary=1;
+		if(report == REPORT_LINES && !out->binary)
+		{
+			if(found)
+				print_long(line, before+end, next, 1, at, excerpt, elen, out);
+			else
+				print_long(line, before+end, next, 0, 0, head, hlen, out);
+		}
+	}
+	else if(context && out->after > 0 && !out->binary)
+	{
+		put_prefix(out, line, '-');
+		put_long(out, before+end, 0, 0, head, hlen);
+		out->after--;
+		out->shown=next;
+	}
+
+	if(line_numbers)
+		out->line=line_number(out, line) - 1 + (nl != NULL);
+	out->offset=next;
+	if(nl == NULL)
+		return 0;
+	if(out->held != NULL)
+		hold_line(out, offset, number, before+end, head, hlen);
+	n=len - (end+1);
+	memmove(line, nl+1, n);
+	return n;
+}
+
+/*Searches the len bytes at data, which are the whole of a file, and
+  finishes the file.
+  Returns 0, or -1 with errno set.
+*/
+int grep_whole(const char *data, size_t len, struct output *out)
+{
+	int ret=0;
+
+	check_binary(data, len, out);
+	if((out->binary && binary_files == BINARY_SKIP) || max_count == 0)
+		;
+	/*Output straight to a stream means this isn't a worker already.
+	  Pieces are all searched to the end, so there's no stopping
+	  early, and context would have to be stitched together across
+	  them; leave those files to one thread.
+	*/
+	else if(out->f != NULL && jobs > 1 && len >= 2*CHUNK_SIZE && !out->binary && max_count == ULONG_MAX && !context)
+		ret=grep_chunks(data, len, out);
+	else
+		grep_lines(data, len, 1, MAPPED_CRLF, out);
+	finish_file(out);
+	return (ret == 0) ? check_output(out) : ret;
+}
+
+/*Whether the mapped file in has holes.  One that fits in a block isn't
+  worth asking about.
+*/
+int has_holes(FILE *in, size_t len)
+{
+	uint64_t start, end;
+
+	if(len <= BLOCK_SIZE)
+		return 0;
+	switch(wing_find_data(in, 0, &start, &end))
+	{
+	case 0:
+		return 1;
+	case 1:
+		return start > 0 || end < len;
+	}
+	return 0;
+}
+
+/*Whether the len bytes at p, a piece of a line that a hole cuts into,
+  have a match in them.  bol and eol say whether they start and end the
+  line; where they don't, there's a hole's nul on that side, which a
+  match can see, for -w, but not go past.
+*/
+int piece_matches(const char *p, size_t len, int bol, int eol)
+{
+	regmatch_t m;
+
+	return first_match(p - !bol, !bol, len + !bol + !eol, bol, eol, &m);
+}
+
+/*Searches a mapped sparse file, a stretch of stored data at a time.
+  The holes between read as nuls, gigabytes of them, perhaps, so they
+  aren't read: they make the file binary, as any nuls would, and each
+  is a boundary no match can cross.  A line a hole cuts into is still
+  one line, which matches if any piece of it does.
+  Returns 0, or -1 with errno set.
+*/
+int grep_sparse(FILE *in, const char *data, size_t len, struct output *out)
+{
+	uint64_t pos=0;
+	uint64_t start, end;
+	const char *line=data;	/*the start of the line not yet searched*/
+	const char *piece=data;	/*of it, since the last hole*/
+	const char *p;
+	const char *nl;
+	size_t n;
+	int cut=0;	/*a hole cuts into that line*/
+	int found=0;	/*a piece of it before piece matches*/
+
+	/*As check_binary would find, were the holes read*/
+	if(binary_files == BINARY_SKIP || (binary_files == BINARY_REPORT && report == REPORT_LINES))
+		out->binary=1;
+	if((out->binary && binary_files == BINARY_SKIP) || max_count == 0)
+		pos=len;
+	while(pos < len && !file_done(out))
+	{
+		switch(wing_find_data(in, pos, &start, &end))
+		{
+		case 0:
+			start=end=len;
+		break;
+		case -1:
+			start=pos;
+			end=len;
+		break;
+		}
+		/*The file can change after it's mapped*/
+		if(end > len)
+			end=len;
+		if(start > end)
+			start=end;
+		if(start > pos)
+		{
+			if(!found)
+				found=piece_matches(piece, (size_t)(data+pos - piece), !cut, 0);
+			cut=1;
+			piece=data+start;
+		}
+		p=data+start;
+		if(cut)
+		{
+			/*The rest of the line the hole cut into*/
+			if((nl=memchr(p, '\n', (size_t)(end-start))) == NULL)
+			{
+				pos=end;
+				continue;
+			}
+			n=(size_t)(nl-piece);
+			if(MAPPED_CRLF && n > 0 && piece[n-1] == '\r')
+				n--;
+			if(!found)
+				found=piece_matches(piece, n, 0, 1);
+			if(found != invert)
+				out->matched++;
+			cut=found=0;
+			p=nl+1;
+			if(file_done(out))
+				break;
+		}
+		else
+			p=line;
+		out->offset=(uintmax_t)(p-data);
+		out->floor=p;
+		line=piece=p + grep_lines(p, (size_t)(data+end - p), end == len, MAPPED_CRLF, out);
+		out->floor=NULL;
+		pos=end;
+	}
+	/*A line a hole cut into, to the end of the file*/
+	if(cut && !file_done(out))
+	{
+		if(!found)
+			found=piece_matches(piece, (size_t)(data+len - piece), 0, 1);
+		if(found != invert)
+			out->matched++;
+	}
+	finish_file(out);
+	return check_output(out);
+}
 
 /*Reads lines from in, and writes ones that match grep_regex to out.
+  Regular files are mapped and searched where they lie, skipping any
+  holes; anything else is read in big blocks, with threads to read and
+  write standard input if there are -j threads to spare.
   If an error occurs (on file read or memory allocation), returns
-  -1 immediately.  On successful completion, returns zero.
+  -1.  On successful completion, returns zero.
   Does not close streams.
 */
-int grep_file(FILE *in, FILE *out)
+int grep_file(FILE *in, struct output *out)
 {
-	char *readbuf;
-	size_t readsize=0;
-	char *newline;
-	int errno_save=0;
+	struct wing_map map;
+	char *buf;
+	size_t size=BLOCK_SIZE;
+	size_t have=0;
+	size_t got;
+	size_t used;
+	size_t kept=0;	/*bytes of lines before the unsearched ones*/
+	size_t drop;
+	/*kept lines, and a line of up to long_lines bytes, plus its newline*/
+	size_t max_size=(long_lines != 0) ? 2*long_lines + 1 : SIZE_MAX;
+	int first=1;
+	int eof=0;
+	int errno_save;
+	struct stream *s=NULL;
+	struct readahead ra={0};
+	struct held held={0};
 
-	if((readbuf=malloc(readsize=128)) == NULL)
-		return -1;
+	/*A mapping starts at the beginning of the file, wherever in is*/
+	if(ftell(in) == 0 && wing_map(in, &map) == 0)
+	{
+		int ret;
+		wing_map_sequential(&map);
+		/*-a prints lines with the holes' nuls in them, so reads them*/
+		if(!(binary_files == BINARY_TEXT && report == REPORT_LINES) && has_holes(in, map.len))
+			ret=grep_sparse(in, map.data, map.len, out);
+		else
+			ret=grep_whole(map.data, map.len, out);
+		wing_unmap(&map);
+		return ret;
+	}
 
-	while(fgets(readbuf, readsize, in))
+	if(size > max_size)
+		size=max_size;
+	if((buf=malloc(size)) == NULL)
+		return -1;
+	/*With -M, lines -B wants can be too many or too long to keep*/
+	if(long_lines != 0 && before_context > 0 && report == REPORT_LINES)
+		out->held=&held;
+	if(in == stdin && out->f != NULL && jobs > 1 && (s=start_stream(in, out->f)) != NULL)
+		out->f=NULL;
+	/*Without it, a small buffer would mean a system call a line*/
+	else if(size < BLOCK_SIZE)
+		ra.data=malloc(BLOCK_SIZE);
+	for(;;)
 	{
-		/*Make sure we have a whole line*/
-		newline=strchr(readbuf, '\n');
-		while(newline == NULL)
+		if(have == size && long_lines != 0 && have - kept > long_lines)
+		{
+			/*Too long to keep; it goes by in windows*/
+			out->floor=buf;
+			have=grep_long_line(in, s, &ra, buf+kept, have-kept, size-kept, &eof, out);
+			memmove(buf, buf+kept, have);
+			kept=0;
+			if(file_done(out))
+			{
+				have=0;
+				break;
+			}
+			if(eof)
+				break;
+			continue;
+		}
+		if(have == size)
 		{
-			size_t old_readsize=readsize;
-			char *t=realloc(readbuf, 2*readsize);
-			if(t==NULL)
+			/*A line longer than the buffer*/
+			size_t grow=(size < max_size/2) ? 2*size : max_size;
+			char *t=realloc(buf, grow);
+			if(t == NULL)
 			{
 				errno_save=errno;
-				free(readbuf);
+				free(buf);
+				free(ra.data);
+				free_held(&held);
+				out->held=NULL;
+				if(s != NULL)
+					end_stream(s, out);
 				errno=errno_save;
 				return -1;
 			}
-			readsize*=2;
-			readbuf=t;
-			if(fgets(readbuf+old_readsize, old_readsize, in)==NULL)
+			buf=t;
+			size=grow;
+		}
+		got=read_input(in, s, buf+have, size-have, &ra);
+		/*EOF or read error; either way, finish the last line*/
+		if(got == 0)
+			break;
+		if(first)
+		{
+			check_binary(buf, got, out);
+			if((out->binary && binary_files == BINARY_SKIP) || max_count == 0)
 			{
-				/*No newline at EOF, or read error.
-				  Process this line before we bail out.
-				*/
-				errno_save=errno;
-				break;
+				free(buf);
+				free(ra.data);
+				free_held(&held);
+				out->held=NULL;
+				finish_file(out);
+				if(s != NULL && end_stream(s, out) != 0)
+					return -1;
+				return check_output(out);
 			}
-			newline=strchr(readbuf, '\n');
+			first=0;
+		}
+		have+=got;
+		out->floor=buf;
+		used=kept + grep_lines(buf+kept, have-kept, 0, 0, out);
+		drop=(context && before_context > 0) ? keep_before(buf, used, out) : used;
+		memmove(buf, buf+drop, have-drop);
+		have-=drop;
+		kept=used-drop;
+		if(file_done(out))
+		{
+			have=kept=0;
+			break;
 		}
+		/*More input may be a while coming; what's found so far is
+		  shown now*/
+		if(s != NULL)
+			stream_flush(s, out);
+		else if(out->f != NULL && ra.pos == ra.len)
+			fflush(out->f);
+	}
+	out->floor=buf;
+	grep_lines(buf+kept, have-kept, 1, 0, out);
+	out->floor=NULL;
+	free(buf);
+	free(ra.data);
+	free_held(&held);
+	out->held=NULL;
+	finish_file(out);
 
-		if(regexec(&grep_regex, readbuf, 0, NULL, 0) == 0)
+	if(s != NULL)
+	{
+		if(end_stream(s, out) != 0)
+			return -1;
+	}
+	else if(ra.err != 0)
+	{
+		errno=ra.err;
+		return -1;
+	}
+	return check_output(out);
+}
+
+/*What's kept in the result cache for a file, followed by its output.
+  The output is as it would be for the first file, without a separator
+  before its first group of context.
+*/
+struct cached_result
+{
+	unsigned long matched;
+	int shown_any;
+};
+
+/*Writes out the result of searching file, if it's in the cache.
+  Returns nonzero if it was.
+*/
+int replay_result(const char *file, const struct wing_stamp *stamp, struct output *out)
+{
+	struct cached_result r;
+	const char *data;
+	size_t len;
+
+	if(!filecache_find(grep_results, file, stamp, results_query, &data, &len) || len < sizeof r)
+		return 0;
+	memcpy(&r, data, sizeof r);
+	if(out->separate && r.shown_any)
+		put(out, "--\n", 3);
+	put(out, data + sizeof r, len - sizeof r);
+	out->matched+=r.matched;
+	out->shown_any|=r.shown_any;
+	return 1;
+}
+
+/*Puts the len bytes of output at data from searching file into the
+  cache.  out was set to separate its first group if separate is set.
+*/
+void save_result(const char *file, const struct wing_stamp *stamp, const struct output *out,
+	const char *data, size_t len, int separate)
+{
+	struct cached_result r;
+	char *record;
+
+	if(separate && out->shown_any && len >= 3)
+	{
+		data+=3;
+		len-=3;
+	}
+	if(len > SIZE_MAX - sizeof r || (record=malloc(sizeof r + len)) == NULL)
+		return;
+	memset(&r, 0, sizeof r);
+	r.matched=out->matched;
+	r.shown_any=out->shown_any;
+	memcpy(record, &r, sizeof r);
+	if(len > 0)
+		memcpy(record + sizeof r, data, len);
+	filecache_add(grep_results, file, stamp, results_query, record, sizeof r + len);
+	free(record);
+}
+
+/*Settles file without reading it, from the index or the result cache,
+  if either can, and puts the error if any in *err.
+  Returns nonzero if it did; otherwise *caching says whether the results
+  of searching it go in the cache, under *stamp.
+*/
+int settle_file(const char *file, struct output *out, struct wing_stamp *stamp, int *caching, int *err)
+{
+	*caching=0;
+	*err=0;
+	if(grep_index != NULL && !windex_may_match(grep_index, file))
+	{
+		finish_file(out);
+		*err=(check_output(out) == 0) ? 0 : errno;
+		return 1;
+	}
+	/*Stamped before it's read, so a change made meanwhile shows next time*/
+	if(grep_results != NULL && wing_stamp(file, stamp) == 0)
+	{
+		if(replay_result(file, stamp, out))
 		{
-			matched++;
-			fputs(readbuf, out);
+			*err=(check_output(out) == 0) ? 0 : errno;
+			return 1;
 		}
+		*caching=1;
+	}
+	return 0;
+}
+
+/*Opens and searches file, which settle_file couldn't settle.
+  Returns 0, or an errno value if it couldn't be searched.
+*/
+int open_and_search(const char *file, struct output *out, const struct wing_stamp *stamp, int caching)
+{
+	struct output tee={0};
+	size_t start=out->len;
+	int separate=out->separate;
+	int err=0;
+	FILE *in;
+
+	if(caching && out->f != NULL)
+	{
+		/*Output that's too big to keep isn't worth holding on to*/
+		tee.limit=(results_limit < SIZE_MAX) ? (size_t)results_limit : SIZE_MAX;
+		out->tee=&tee;
+	}
+	if((in=fopen(file, "r")) == NULL)
+		err=errno;
+	else
+	{
+		if(grep_file(in, out) == -1)
+			err=errno;
+		fclose(in);
+	}
+	out->tee=NULL;
+	if(caching && err == 0)
+	{
+		if(out->f == NULL)
+			save_result(file, stamp, out, out->buf + start, out->len - start, separate);
+		else if(!tee.nomem)
+			save_result(file, stamp, out, tee.buf, tee.len, separate);
 	}
+	free(tee.buf);
+	return err;
+}
+
+/*Searches the named file.
+  Returns 0, or an errno value if it couldn't be searched.
+*/
+int search_file(const char *file, struct output *out)
+{
+	struct wing_stamp stamp;
+	int caching;
+	int err;
 
-	if(errno_save != 0)
-		errno=errno_save;
-	return feof(in) ? 0 : -1;
+	if(settle_file(file, out, &stamp, &caching, &err))
+		return err;
+	return open_and_search(file, out, &stamp, caching);
 }
 
-int do_grep(const char *file, void *venv)
+/*Searches the n files of a batch of jobs, reading the small ones all
+  at once with reader.  Their output is kept in memory, as for any job.
+*/
+void search_batch(struct job **batch, size_t n, struct wing_batch *reader)
 {
-	int *error_occurred = venv;
-	FILE *in=fopen(file, "r");
-	if(in==NULL)
+	struct wing_batch_file files[BATCH_FILES];
+	struct wing_stamp stamps[BATCH_FILES];
+	int caching[BATCH_FILES];
+	size_t which[BATCH_FILES];	/*the job for each of files*/
+	size_t nfiles=0;
+	size_t i;
+
+	for(i=0; i < n; i++)
 	{
-		perror(file);
-		*error_occurred=1;
-		return 0;
+		batch[i]->out.name=batch[i]->name;
+		if(settle_file(batch[i]->name, &batch[i]->out, &stamps[i], &caching[i], &batch[i]->err))
+			continue;
+		files[nfiles].path=batch[i]->name;
+		which[nfiles++]=i;
+	}
+	wing_batch_read(reader, files, nfiles);
+	/*The files left over are read after the rest are searched; with -O,
+	  they're in order, so the disk can get on with them meanwhile*/
+	if(disk_order)
+	{
+		for(i=0; i < nfiles; i++)
+			if(files[i].data == NULL && files[i].err == 0)
+				wing_prefetch(files[i].path, PREFETCH_SIZE);
+	}
+	for(i=0; i < nfiles; i++)
+	{
+		struct job *j=batch[which[i]];
+
+		if(files[i].err != 0)
+			j->err=files[i].err;
+		else if(files[i].data == NULL)
+			j->err=open_and_search(j->name, &j->out, &stamps[which[i]], caching[which[i]]);
+		else
+		{
+			j->err=(grep_whole(files[i].data, files[i].len, &j->out) == 0) ? 0 : errno;
+			if(caching[which[i]] && j->err == 0)
+				save_result(j->name, &stamps[which[i]], &j->out, j->out.buf, j->out.len, 0);
+		}
 	}
-	if(grep_file(in, stdout) == -1)
+}
+
+int do_grep(const char *file, void *venv)
+{
+	int *error_occurred = venv;
+	struct output out={0};
+	int err;
+
+	out.f=stdout;
+	out.name=file;
+	out.separate=context_shown;
+	err=search_file(file, &out);
+	matched+=out.matched;
+	context_shown|=out.shown_any;
+	if(err != 0)
 	{
-		perror(file);
+		fprintf(stderr, "%s: %s\n", file, strerror(err));
 		*error_occurred=1;
 	}
-	fclose(in);
-	return 0;
+	/*-q has its answer; stop at this file*/
+	return report == REPORT_NOTHING && matched > 0;
 }
 
 void usage_and_die(const char *myname, int status)
 {
 	/* TODO: Make sure usage is updated as features are implemented! */
-	fprintf(stderr, "Usage: %s [-EF] <pattern> [file ...]\n", myname);
+	fprintf(stderr, "Usage: %s [-EFILOXabclnoqruvwx] [-A lines] [-B lines] [-C lines] [-j jobs] [-k errors] [-K cachefile] [-m count] [-M bytes] [-N bytes] [-S cachefile] [-T indexfile] <pattern> [file ...]\n", myname);
 	exit(status);
 }
 
+/*Parses the line count for -A, -B or -C, or dies*/
+unsigned long context_count(const char *myname, const char *arg)
+{
+	char *endptr;
+	unsigned long n=strtoul(arg, &endptr, 10);
+	if(*arg == '\0' || *arg == '-' || *endptr != '\0')
+	{
+		fprintf(stderr, "%s: Bad context length '%s'\n", myname, arg);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+/*Compiles pattern into preg, going through the pattern cache if there
+  is one.
+*/
+int compile(regex_t *preg, const char *pattern, int cflags)
+{
+	if(grep_cache != NULL)
+		return regcache_comp(grep_cache, preg, pattern, cflags);
+	return regcomp(preg, pattern, cflags);
+}
+
+/*Frees the compiled patterns, and saves them in the pattern cache if
+  there is one.
+  Failing to save the cache is worth a warning, but not a failure.
+*/
+void release_regex(const char *myname)
+{
+	regfree(&grep_regex);
+	if(buffer_search)
+		regfree(&buffer_regex);
+	buffer_search = 0;
+	if(grep_approx != NULL)
+		regapprox_free(grep_approx);
+	grep_approx = NULL;
+	if(grep_cache != NULL && regcache_close(grep_cache) != 0)
+		fprintf(stderr, "%s: %s: Can't save pattern cache: %s\n", myname, cache_file, strerror(errno));
+	grep_cache = NULL;
+	if(grep_index != NULL)
+		windex_close(grep_index);
+	grep_index = NULL;
+	if(grep_results != NULL && filecache_close(grep_results) != 0)
+		fprintf(stderr, "%s: %s: Can't save result cache: %s\n", myname, results_file, strerror(errno));
+	grep_results = NULL;
+	free(results_query);
+	results_query = NULL;
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
 	int i;
 	int ret;
 	int error_occurred=0;
+	int explain=0;
+	int quiet=0;
+	char *endptr;
 
-	while((opt = getopt(argc, argv, "EF")) != -1)
+	while((opt = getopt(argc, argv, "A:B:C:EFILOXabclnoqruvwxj:k:K:m:M:N:S:T:")) != -1)
 	{
 		switch(opt)
 		{
@@ -109,6 +2453,116 @@ int main(int argc, char **argv)
 		case 'F':
 			match_type = REG_NOSPEC;
 		break;
+		case 'I':
+			binary_files = BINARY_SKIP;
+		break;
+		case 'L':
+			report = REPORT_NONMATCHING;
+		break;
+		case 'O':
+			disk_order = 1;
+		break;
+		case 'X':
+			explain = 1;
+		break;
+		case 'a':
+			binary_files = BINARY_TEXT;
+		break;
+		case 'c':
+			report = REPORT_COUNT;
+		break;
+		case 'l':
+			report = REPORT_MATCHING;
+		break;
+		case 'q':
+			quiet = 1;
+		break;
+		case 'j':
+			jobs = (int)strtol(optarg, &endptr, 10);
+			if(jobs < 1 || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad job count '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'k':
+			max_errors = (int)strtol(optarg, &endptr, 10);
+			if(max_errors < 0 || *optarg == '\0' || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad error count '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'K':
+			cache_file = optarg;
+		break;
+		case 'm':
+			max_count = strtoul(optarg, &endptr, 10);
+			if(*optarg == '\0' || *optarg == '-' || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad match count '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'M':
+			long_lines = (size_t)strtoul(optarg, &endptr, 10);
+			if(long_lines == 0 || *optarg == '-' || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad line length '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'N':
+			results_limit = (uint64_t)strtoull(optarg, &endptr, 10);
+			if(*optarg == '\0' || *optarg == '-' || *endptr != '\0')
+			{
+				fprintf(stderr, "%s: Bad cache size '%s'\n", argv[0], optarg);
+				exit(EXIT_FAILURE);
+			}
+		break;
+		case 'S':
+			results_file = optarg;
+		break;
+		case 'T':
+			index_file = optarg;
+		break;
+		case 'A':
+			after_context = context_count(argv[0], optarg);
+			context = 1;
+		break;
+		case 'B':
+			before_context = context_count(argv[0], optarg);
+			context = 1;
+		break;
+		case 'C':
+			before_context = after_context = context_count(argv[0], optarg);
+			context = 1;
+		break;
+		case 'b':
+			byte_offsets = 1;
+		break;
+		case 'n':
+			line_numbers = 1;
+		break;
+		case 'o':
+			only_matching = 1;
+		break;
+		case 'r':
+			recursive = 1;
+		break;
+		case 'u':
+			utf8 = REG_UTF8;
+		break;
+		case 'v':
+			invert = 1;
+		break;
+		case 'w':
+			if(whole == 0)
+				whole = REG_WORD;
+		break;
+		case 'x':
+			whole = REG_LINE;
+		break;
 		case '?':
 			usage_and_die(argv[0], EXIT_FAILURE);
 		/*not reached*/
@@ -126,7 +2580,21 @@ int main(int argc, char **argv)
 		/*not reached*/
 	}
 
-	ret=regcomp(&grep_regex, argv[optind], REG_NOSUB | match_type);
+	if(quiet)
+		report = REPORT_NOTHING;
+	/*Whether a file matches is settled by its first matching line*/
+	if(report >= REPORT_MATCHING && max_count > 1)
+		max_count = 1;
+	/*Context is for whole lines*/
+	if(report != REPORT_LINES || only_matching)
+		context = 0;
+
+	if(cache_file != NULL && (grep_cache=regcache_open(cache_file)) == NULL)
+	{
+		fprintf(stderr, "%s: %s: Out of memory\n", argv[0], cache_file);
+		exit(EXIT_FAILURE);
+	}
+	ret=compile(&grep_regex, argv[optind], REG_NOSUB | match_type | utf8 | whole);
 	if(ret != 0)
 	{
 		char errbuf[256];
@@ -135,23 +2603,148 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	if(argc == optind+1)
+	if(max_errors >= 0 && (ret=regapprox_comp(&grep_approx, &grep_regex, max_errors)) != 0)
+	{
+		if(ret == REG_INVARG)
+			fprintf(stderr, "%s: -k needs a plain literal pattern of at most 64 bytes\n", argv[0]);
+		else
+			fprintf(stderr, "%s: Out of memory\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(long_lines != 0)
+	{
+		struct reginfo info;
+		size_t longest=(size_t)-1;
+		if(reginfo(&grep_regex, &info) == 0)
+			longest=info.maxlen;
+		/*Approximate matches can have up to max_errors extra bytes*/
+		if(grep_approx != NULL && longest != (size_t)-1)
+			longest+=(size_t)max_errors;
+		window_overlap=(longest < long_lines/2) ? longest+1 : long_lines/2;
+	}
+
+	/*Matches from buffer_regex only cross a newline through a set that
+	  holds one, like [[:space:]], and search_lines checks those lines
+	  again on their own.  A pattern with a newline in it no line could
+	  match, and approximate matches can cross newlines, so those go
+	  line by line.
+	*/
+	if(grep_approx == NULL && strchr(argv[optind], '\n') == NULL &&
+		compile(&buffer_regex, argv[optind], REG_NOSUB | REG_NEWLINE | match_type | utf8 | whole) == 0)
+		buffer_search = 1;
+
+	/*The index knows which files hold a literal, so it's no help with
+	  -v, or with approximate matches that needn't contain the literal*/
+	if(index_file != NULL && !invert && grep_approx == NULL && !explain)
+	{
+		struct reginfo info;
+		if((grep_index=windex_open(index_file)) == NULL)
+			fprintf(stderr, "%s: %s: Can't use index, searching everything: %s\n", argv[0], index_file,
+				(errno == EINVAL) ? "Not a usable index" : strerror(errno));
+		else if(reginfo(&grep_regex, &info) != 0
+			|| windex_require(grep_index, info.must, info.mlen) != 0
+			|| windex_require(grep_index, info.prefix, info.plen) != 0)
+		{
+			windex_close(grep_index);
+			grep_index = NULL;
+		}
+	}
+
+	if(explain)
+	{
+		/*Describe the compiled pattern instead of searching*/
+		regexplain(&grep_regex, stdout);
+		release_regex(argv[0]);
+		return 0;
+	}
+
+	if(jobs == 0)
+		jobs=wing_ncpus();
+	if(argc == optind+1 && !recursive)
 	{
-		if(grep_file(stdin, stdout) == -1)
+		struct output out={0};
+		out.f=stdout;
+		out.name="(standard input)";
+		if(grep_file(stdin, &out) == -1)
 		{
 			perror("(stdin)");
 			exit(EXIT_FAILURE);
 		}
-		return 0;
+		matched+=out.matched;
+		release_regex(argv[0]);
+		return matched == 0;
 	}
 
-	for(i=optind+1; i<argc; i++)
+	with_filenames=(recursive || argc > optind+2);
+	if(results_file != NULL)
+	{
+		/*The output for a file depends on all of these, and the pattern*/
+		if((results_query=malloc(strlen(argv[optind]) + 512)) == NULL
+			|| (grep_results=filecache_open(results_file, results_limit)) == NULL)
+		{
+			fprintf(stderr, "%s: %s: Out of memory\n", argv[0], results_file);
+			exit(EXIT_FAILURE);
+		}
+		sprintf(results_query, "%d %d %d %d %d %d %d %d %d %d %lu %lu %lu %d %lu %d:%s",
+			match_type, utf8, whole, invert, report, binary_files, with_filenames,
+			line_numbers, byte_offsets, only_matching, before_context, after_context,
+			max_count, max_errors, (unsigned long)long_lines, context, argv[optind]);
+	}
+	if(recursive || argc > optind+2)
 	{
-		if(wing_glob_foreach(argv[i], do_grep, &error_occurred) == 0)
-			fprintf(stderr, "%s: %s: No such file\n", argv[0], argv[i]);
+		/*Find all the files first, then search them concurrently, or
+		  in batches on this thread.
+		  With -r, the directories are walked by the same threads
+		  as the files they hold are searched.
+		*/
+		struct pool pool={0};
+		struct output out={0};
+		out.f=stdout;
+		pool.dest=&out;
+		for(i=optind+1; i<argc; i++)
+		{
+			size_t before=pool.njobs;
+			ret=wing_glob_foreach(argv[i], add_job, &pool);
+			if(ret == 0)
+				fprintf(stderr, "%s: %s: No such file\n", argv[0], argv[i]);
+			else if(ret > 0 && pool.njobs - before < (size_t)ret)
+			{
+				fprintf(stderr, "%s: Out of memory\n", argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if(argc == optind+1 && add_job(".", &pool) != 0)
+		{
+			fprintf(stderr, "%s: Out of memory\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if(jobs == 1 || run_pool(&pool, jobs) != 0)
+		{
+			/*No threads to be had; do it the slow way*/
+			run_inline(&pool);
+		}
+		matched+=out.matched;
+		/*-q stops without writing the match out*/
+		if(pool.quit)
+			matched++;
+		if(pool.failed || pool.err != 0)
+			error_occurred=1;
+		free_pool(&pool);
+	}
+	else
+	{
+		for(i=optind+1; i<argc && !(report == REPORT_NOTHING && matched > 0); i++)
+		{
+			if(wing_glob_foreach(argv[i], do_grep, &error_occurred) == 0)
+				fprintf(stderr, "%s: %s: No such file\n", argv[0], argv[i]);
+		}
 	}
 
-	regfree(&grep_regex);
+	release_regex(argv[0]);
 
+	/*A match is a match for -q, errors or not*/
+	if(report == REPORT_NOTHING && matched > 0)
+		return 0;
 	return error_occurred ? EXIT_FAILURE : (matched==0);
 }
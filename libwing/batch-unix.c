@@ -0,0 +1,377 @@
+#define _POSIX_C_SOURCE 200809L
+/*syscall() isn't POSIX*/
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwing.h"
+
+/*Files are opened without blocking, so that a FIFO can't hold up the
+  rest of the batch; only regular files are read.
+*/
+#define OPEN_FLAGS (O_RDONLY | O_NONBLOCK)
+
+#ifdef __linux__
+/*Each batch goes through an io_uring in three rounds: open every file,
+  read the regular ones that are small enough, and close them all.
+  Which ones those are comes from fstat in between, since io_uring hands
+  every statx to a kernel thread, which costs more than the call saves.
+  That leaves one system call per file and three for the batch, where
+  one file at a time takes four.
+  There's no liburing to lean on, so this drives the rings itself.  A
+  kernel without io_uring, or without the operations used here (5.6 or
+  later), gets the plain loop below instead.
+*/
+#define USE_RING 1
+
+struct ring
+{
+	int fd;
+	void *sq_map;
+	size_t sq_map_len;
+	void *cq_map;
+	size_t cq_map_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+#endif
+
+struct wing_batch
+{
+	size_t nfiles;
+	size_t maxlen;
+	char *buf;	/*nfiles buffers of maxlen+1 bytes, so a file that's too long shows*/
+	int *fds;
+#ifdef USE_RING
+	struct ring ring;
+	int have_ring;
+#endif
+};
+
+#ifdef USE_RING
+static void ring_free(struct ring *r)
+{
+	if(r->sqes != NULL)
+		munmap(r->sqes, r->sqes_len);
+	if(r->cq_map != NULL && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if(r->sq_map != NULL)
+		munmap(r->sq_map, r->sq_map_len);
+	if(r->fd >= 0)
+		close(r->fd);
+}
+
+/*Returns 0 if the ring could be set up with room for entries at a time*/
+static int ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof *r);
+	memset(&p, 0, sizeof p);
+	if((r->fd=(int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	r->sq_map_len=p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len=p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(r->cq_map_len > r->sq_map_len)
+			r->sq_map_len=r->cq_map_len;
+		r->cq_map_len=r->sq_map_len;
+	}
+	r->sq_map=mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_map == MAP_FAILED)
+	{
+		r->sq_map=NULL;
+		ring_free(r);
+		return -1;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map=r->sq_map;
+	else if((r->cq_map=mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+	{
+		r->cq_map=NULL;
+		ring_free(r);
+		return -1;
+	}
+	r->sqes_len=p.sq_entries * sizeof(struct io_uring_sqe);
+	if((r->sqes=mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+	{
+		r->sqes=NULL;
+		ring_free(r);
+		return -1;
+	}
+	sq=r->sq_map;
+	cq=r->cq_map;
+	r->sq_tail=(unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask=(unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array=(unsigned *)(sq + p.sq_off.array);
+	r->cq_head=(unsigned *)(cq + p.cq_off.head);
+	r->cq_tail=(unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask=(unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes=(struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+/*Returns the next free submission, cleared.  Only as many are taken
+  between submits as the ring has entries.
+*/
+static struct io_uring_sqe *ring_sqe(struct ring *r, unsigned queued)
+{
+	unsigned tail=*r->sq_tail + queued;
+	unsigned i=tail & *r->sq_mask;
+	struct io_uring_sqe *sqe=&r->sqes[i];
+
+	memset(sqe, 0, sizeof *sqe);
+	r->sq_array[i]=i;
+	return sqe;
+}
+
+/*Hands over the n queued submissions, and waits for all of them to
+  complete, calling done for each.
+  Returns 0, or -1 with errno set if the kernel wouldn't take them.
+*/
+static int ring_run(struct ring *r, unsigned n, void (*done)(void *arg, uint64_t data, int res), void *arg)
+{
+	unsigned head;
+	unsigned seen=0;
+	unsigned submit=n;
+	long ret;
+
+	/*The kernel mustn't see the new tail before the entries*/
+	__atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+	while(seen < n)
+	{
+		ret=syscall(__NR_io_uring_enter, r->fd, submit, n - seen, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0 && errno != EINTR)
+			return -1;
+		if(ret > 0)
+			submit-=(unsigned)ret;
+		head=*r->cq_head;
+		while(head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe=&r->cqes[head & *r->cq_mask];
+			done(arg, cqe->user_data, cqe->res);
+			head++;
+			seen++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+#endif
+
+struct wing_batch *wing_batch_new(size_t nfiles, size_t maxlen)
+{
+	struct wing_batch *b=calloc(1, sizeof *b);
+
+	if(b == NULL)
+		return NULL;
+	b->nfiles=nfiles;
+	b->maxlen=maxlen;
+	if(maxlen >= SIZE_MAX / (nfiles ? nfiles : 1) - 1 || (b->buf=malloc(nfiles * (maxlen+1))) == NULL
+		|| (b->fds=calloc(nfiles, sizeof *b->fds)) == NULL)
+	{
+		wing_batch_free(b);
+		return NULL;
+	}
+#ifdef USE_RING
+	b->have_ring=(nfiles <= 4096 && ring_init(&b->ring, (unsigned)nfiles) == 0);
+#endif
+	return b;
+}
+
+/*The same, one file at a time*/
+static void read_plainly(struct wing_batch *b, struct wing_batch_file *files, size_t n)
+{
+	struct stat st;
+	char *buf;
+	ssize_t ret;
+	size_t i;
+	int fd;
+
+	for(i=0; i < n; i++)
+	{
+		files[i].data=NULL;
+		files[i].len=0;
+		files[i].err=0;
+		if((fd=open(files[i].path, OPEN_FLAGS)) < 0)
+		{
+			files[i].err=errno;
+			continue;
+		}
+		if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uintmax_t)st.st_size <= b->maxlen)
+		{
+			/*A short read of a regular file only happens at the end*/
+			buf=b->buf + i*(b->maxlen+1);
+			if((ret=read(fd, buf, b->maxlen+1)) >= 0 && (size_t)ret <= b->maxlen)
+			{
+				files[i].data=buf;
+				files[i].len=(size_t)ret;
+			}
+		}
+		close(fd);
+	}
+}
+
+#ifdef USE_RING
+/*What each completion is for: the file's number, and which of these*/
+#define OP_OPEN 0
+#define OP_READ 1
+#define OP_CLOSE 2
+#define USER_DATA(i, op) ((uint64_t)(i) << 2 | (op))
+
+struct completions
+{
+	struct wing_batch *b;
+	struct wing_batch_file *files;
+	int unsupported;	/*the kernel doesn't know an operation*/
+};
+
+static void completed(void *arg, uint64_t data, int res)
+{
+	struct completions *c=arg;
+	size_t i=(size_t)(data >> 2);
+
+	switch(data & 3)
+	{
+	case OP_OPEN:
+		c->b->fds[i]=res;
+		if(res == -EINVAL || res == -EOPNOTSUPP)
+			c->unsupported=1;
+		else if(res < 0)
+			c->files[i].err=-res;
+	break;
+	case OP_READ:
+		if(res == -EINVAL || res == -EOPNOTSUPP)
+			c->unsupported=1;
+		else if(res >= 0 && (size_t)res <= c->b->maxlen)
+		{
+			c->files[i].data=c->b->buf + i*(c->b->maxlen+1);
+			c->files[i].len=(size_t)res;
+		}
+	break;
+	case OP_CLOSE:
+		/*A kernel without IORING_OP_CLOSE leaves it open*/
+		if(res == -EINVAL || res == -EOPNOTSUPP)
+			close(c->b->fds[i]);
+	break;
+	}
+}
+
+/*Returns 0, or -1 if the ring can't do the job, having closed whatever
+  it opened*/
+static int read_ring(struct wing_batch *b, struct wing_batch_file *files, size_t n)
+{
+	struct ring *r=&b->ring;
+	struct io_uring_sqe *sqe;
+	struct completions c;
+	struct stat st;
+	unsigned queued=0;
+	size_t i;
+
+	c.b=b;
+	c.files=files;
+	c.unsupported=0;
+	for(i=0; i < n; i++)
+	{
+		files[i].data=NULL;
+		files[i].len=0;
+		files[i].err=0;
+		b->fds[i]=-1;
+
+		sqe=ring_sqe(r, queued++);
+		sqe->opcode=IORING_OP_OPENAT;
+		sqe->fd=AT_FDCWD;
+		sqe->addr=(uintptr_t)files[i].path;
+		sqe->open_flags=OPEN_FLAGS;
+		sqe->user_data=USER_DATA(i, OP_OPEN);
+	}
+	if(ring_run(r, queued, completed, &c) != 0)
+		c.unsupported=1;
+
+	queued=0;
+	if(!c.unsupported)
+		for(i=0; i < n; i++)
+		{
+			if(b->fds[i] < 0 || fstat(b->fds[i], &st) != 0 || !S_ISREG(st.st_mode)
+				|| (uintmax_t)st.st_size > b->maxlen)
+				continue;
+			sqe=ring_sqe(r, queued++);
+			sqe->opcode=IORING_OP_READ;
+			sqe->fd=b->fds[i];
+			sqe->addr=(uintptr_t)(b->buf + i*(b->maxlen+1));
+			sqe->len=(unsigned)(b->maxlen+1);
+			sqe->off=0;
+			sqe->user_data=USER_DATA(i, OP_READ);
+		}
+	if(queued > 0 && ring_run(r, queued, completed, &c) != 0)
+		c.unsupported=1;
+
+	queued=0;
+	for(i=0; i < n; i++)
+	{
+		if(b->fds[i] < 0)
+			continue;
+		sqe=ring_sqe(r, queued++);
+		sqe->opcode=IORING_OP_CLOSE;
+		sqe->fd=b->fds[i];
+		sqe->user_data=USER_DATA(i, OP_CLOSE);
+	}
+	if(queued > 0 && ring_run(r, queued, completed, &c) != 0)
+	{
+		for(i=0; i < n; i++)
+			if(b->fds[i] >= 0)
+				close(b->fds[i]);
+		c.unsupported=1;
+	}
+	return c.unsupported ? -1 : 0;
+}
+#endif
+
+void wing_batch_read(struct wing_batch *b, struct wing_batch_file *files, size_t n)
+{
+	if(n > b->nfiles)
+		n=b->nfiles;
+#ifdef USE_RING
+	if(b->have_ring)
+	{
+		if(read_ring(b, files, n) == 0)
+			return;
+		/*Not this kernel, then; don't try again*/
+		ring_free(&b->ring);
+		b->have_ring=0;
+	}
+#endif
+	read_plainly(b, files, n);
+}
+
+void wing_batch_free(struct wing_batch *b)
+{
+	if(b == NULL)
+		return;
+#ifdef USE_RING
+	if(b->have_ring)
+		ring_free(&b->ring);
+#endif
+	free(b->fds);
+	free(b->buf);
+	free(b);
+}
@@ -0,0 +1,80 @@
+#include <windows.h>
+#include <io.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libwing.h"
+
+/*There's nothing like io_uring for opening files, so this goes one file
+  at a time, but it still saves mapping small files
+*/
+struct wing_batch
+{
+	size_t nfiles;
+	size_t maxlen;
+	char *buf;	/*nfiles buffers of maxlen+1 bytes, so a file that's too long shows*/
+};
+
+struct wing_batch *wing_batch_new(size_t nfiles, size_t maxlen)
+{
+	struct wing_batch *b=calloc(1, sizeof *b);
+
+	if(b == NULL)
+		return NULL;
+	b->nfiles=nfiles;
+	b->maxlen=maxlen;
+	if(maxlen >= SIZE_MAX / (nfiles ? nfiles : 1) - 1 || (b->buf=malloc(nfiles * (maxlen+1))) == NULL)
+	{
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+void wing_batch_read(struct wing_batch *b, struct wing_batch_file *files, size_t n)
+{
+	LARGE_INTEGER size;
+	HANDLE h;
+	FILE *f;
+	char *buf;
+	size_t got;
+	size_t i;
+
+	if(n > b->nfiles)
+		n=b->nfiles;
+	for(i=0; i < n; i++)
+	{
+		files[i].data=NULL;
+		files[i].len=0;
+		files[i].err=0;
+		if((f=fopen(files[i].path, "rb")) == NULL)
+		{
+			files[i].err=errno;
+			continue;
+		}
+		h=(HANDLE)_get_osfhandle(_fileno(f));
+		if(h != INVALID_HANDLE_VALUE && GetFileType(h) == FILE_TYPE_DISK && GetFileSizeEx(h, &size)
+			&& (unsigned long long)size.QuadPart <= b->maxlen)
+		{
+			buf=b->buf + i*(b->maxlen+1);
+			got=fread(buf, 1, b->maxlen+1, f);
+			if(!ferror(f) && got <= b->maxlen)
+			{
+				files[i].data=buf;
+				files[i].len=got;
+			}
+		}
+		fclose(f);
+	}
+}
+
+void wing_batch_free(struct wing_batch *b)
+{
+	if(b == NULL)
+		return;
+	free(b->buf);
+	free(b);
+}
@@ -0,0 +1,206 @@
+#define _POSIX_C_SOURCE 200809L
+/*d_type and the DT_ constants aren't POSIX*/
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libwing.h"
+
+struct wing_dir
+{
+	DIR *dir;
+};
+
+struct wing_dir *wing_opendir(const char *path)
+{
+	struct wing_dir *d=malloc(sizeof *d);
+	if(d == NULL)
+		return NULL;
+	if((d->dir=opendir(path)) == NULL)
+	{
+		int errno_save=errno;
+		free(d);
+		errno=errno_save;
+		return NULL;
+	}
+	return d;
+}
+
+/*Only when the directory entry doesn't say*/
+static int stat_type(struct wing_dir *d, const char *name)
+{
+	struct stat st;
+
+	if(fstatat(dirfd(d->dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return WING_DT_OTHER;
+	if(S_ISREG(st.st_mode))
+		return WING_DT_FILE;
+	if(S_ISDIR(st.st_mode))
+		return WING_DT_DIR;
+	return WING_DT_OTHER;
+}
+
+int wing_readdir(struct wing_dir *d, const char **name, int *type)
+{
+	struct dirent *e;
+
+	for(;;)
+	{
+		errno=0;
+		if((e=readdir(d->dir)) == NULL)
+			return (errno != 0) ? -1 : 0;
+		if(e->d_name[0] == '.' && (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+			continue;
+		break;
+	}
+
+	*name=e->d_name;
+#ifdef DT_DIR
+	/*Saves a stat per entry on filesystems that fill it in*/
+	switch(e->d_type)
+	{
+	case DT_REG:
+		*type=WING_DT_FILE;
+		return 1;
+	case DT_DIR:
+		*type=WING_DT_DIR;
+		return 1;
+	case DT_UNKNOWN:
+	break;
+	default:
+		*type=WING_DT_OTHER;
+		return 1;
+	}
+#endif
+	*type=stat_type(d, e->d_name);
+	return 1;
+}
+
+void wing_closedir(struct wing_dir *d)
+{
+	closedir(d->dir);
+	free(d);
+}
+
+int wing_stamp(const char *path, struct wing_stamp *st)
+{
+	struct stat sb;
+
+	if(stat(path, &sb) != 0)
+		return -1;
+	st->device=(uint64_t)sb.st_dev;
+	st->inode=(uint64_t)sb.st_ino;
+	st->size=(uint64_t)sb.st_size;
+	st->mtime=(int64_t)sb.st_mtime;
+	/*Whole seconds, and the clock may have just ticked over*/
+	st->recent=(sb.st_mtime >= time(NULL) - 1);
+	return 0;
+}
+
+#ifdef __linux__
+/*Asks for the file's first extent.  Extents that aren't on the disk yet,
+  or are packed in with something else, have no address of their own*/
+static int first_extent(int fd, uint64_t *address)
+{
+	union
+	{
+		struct fiemap map;
+		char space[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} u;
+	const struct fiemap_extent *e=u.map.fm_extents;
+
+	memset(&u, 0, sizeof u);
+	u.map.fm_length=FIEMAP_MAX_OFFSET;
+	u.map.fm_extent_count=1;
+	if(ioctl(fd, FS_IOC_FIEMAP, &u.map) != 0 || u.map.fm_mapped_extents == 0)
+		return -1;
+	if(e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_NOT_ALIGNED))
+		return -1;
+	*address=e->fe_physical;
+	return 0;
+}
+#endif
+
+int wing_place(const char *path, struct wing_place *pl)
+{
+	struct stat sb;
+	int fd;
+
+	/*Without blocking on a fifo*/
+	if((fd=open(path, O_RDONLY | O_NONBLOCK)) < 0)
+	{
+		/*Permission to read isn't needed to say where it is*/
+		if(stat(path, &sb) != 0)
+			return -1;
+	}
+	else if(fstat(fd, &sb) != 0)
+	{
+		int errno_save=errno;
+		close(fd);
+		errno=errno_save;
+		return -1;
+	}
+	pl->device=(uint64_t)sb.st_dev;
+	pl->address=(uint64_t)sb.st_ino;
+	pl->exact=0;
+#ifdef __linux__
+	if(fd >= 0 && S_ISREG(sb.st_mode) && first_extent(fd, &pl->address) == 0)
+		pl->exact=1;
+#endif
+	if(fd >= 0)
+		close(fd);
+	return 0;
+}
+
+FILE *wing_replace_open(const char *path, char **tmp)
+{
+	FILE *f;
+	mode_t mask;
+	int fd;
+
+	if((*tmp=malloc(strlen(path) + sizeof ".XXXXXX")) == NULL)
+		return NULL;
+	sprintf(*tmp, "%s.XXXXXX", path);
+	if((fd=mkstemp(*tmp)) < 0)
+	{
+		int errno_save=errno;
+		free(*tmp);
+		errno=errno_save;
+		return NULL;
+	}
+	/*mkstemp keeps it to the owner; a file made by fopen wouldn't be*/
+	mask=umask(0);
+	umask(mask);
+	fchmod(fd, 0666 & ~mask);
+	if((f=fdopen(fd, "wb")) == NULL)
+	{
+		int errno_save=errno;
+		close(fd);
+		remove(*tmp);
+		free(*tmp);
+		errno=errno_save;
+		return NULL;
+	}
+	return f;
+}
+
+int wing_replace(const char *tmp, const char *path)
+{
+	return rename(tmp, path);
+}
@@ -0,0 +1,240 @@
+#include <windows.h>
+#include <winioctl.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwing.h"
+
+struct wing_dir
+{
+	HANDLE h;
+	WIN32_FIND_DATA fd;
+	int have;	/*fd holds an entry not yet returned*/
+};
+
+static void set_errno(DWORD err)
+{
+	switch(err)
+	{
+	case ERROR_FILE_NOT_FOUND: case ERROR_PATH_NOT_FOUND:
+		errno=ENOENT;
+	break;
+	case ERROR_DIRECTORY:
+		errno=ENOTDIR;
+	break;
+	case ERROR_ACCESS_DENIED:
+		errno=EACCES;
+	break;
+	default:
+		errno=EIO;
+	break;
+	}
+}
+
+struct wing_dir *wing_opendir(const char *path)
+{
+	size_t len=strlen(path);
+	struct wing_dir *d;
+	char *pattern;
+	DWORD attr;
+
+	/*FindFirstFile on "file\*" fails with ERROR_PATH_NOT_FOUND; say why*/
+	attr=GetFileAttributes(path);
+	if(attr == INVALID_FILE_ATTRIBUTES)
+	{
+		set_errno(GetLastError());
+		return NULL;
+	}
+	if(!(attr & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		errno=ENOTDIR;
+		return NULL;
+	}
+
+	if((d=malloc(sizeof *d)) == NULL)
+		return NULL;
+	if((pattern=malloc(len+3)) == NULL)
+	{
+		free(d);
+		return NULL;
+	}
+	memcpy(pattern, path, len);
+	if(len > 0 && path[len-1] != '\\' && path[len-1] != '/')
+		pattern[len++]='\\';
+	strcpy(pattern+len, "*");
+	d->h=FindFirstFile(pattern, &d->fd);
+	free(pattern);
+	if(d->h == INVALID_HANDLE_VALUE)
+	{
+		DWORD err=GetLastError();
+		free(d);
+		set_errno(err);
+		return NULL;
+	}
+	d->have=1;
+	return d;
+}
+
+int wing_readdir(struct wing_dir *d, const char **name, int *type)
+{
+	const char *n;
+
+	for(;;)
+	{
+		if(!d->have && !FindNextFile(d->h, &d->fd))
+		{
+			DWORD err=GetLastError();
+			if(err == ERROR_NO_MORE_FILES)
+				return 0;
+			set_errno(err);
+			return -1;
+		}
+		d->have=0;
+		n=d->fd.cFileName;
+		if(n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0')))
+			continue;
+		break;
+	}
+
+	*name=n;
+	if(d->fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+		*type=WING_DT_OTHER;	/*symbolic links and junctions*/
+	else if(d->fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		*type=WING_DT_DIR;
+	else if(d->fd.dwFileAttributes & FILE_ATTRIBUTE_DEVICE)
+		*type=WING_DT_OTHER;
+	else
+		*type=WING_DT_FILE;
+	return 1;
+}
+
+void wing_closedir(struct wing_dir *d)
+{
+	FindClose(d->h);
+	free(d);
+}
+
+int wing_stamp(const char *path, struct wing_stamp *st)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	FILETIME now;
+	HANDLE h;
+	int ok;
+
+	/*Opening it for nothing at all still gets at its file index*/
+	h=CreateFile(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+	{
+		set_errno(GetLastError());
+		return -1;
+	}
+	ok=GetFileInformationByHandle(h, &info);
+	if(!ok)
+		set_errno(GetLastError());
+	CloseHandle(h);
+	if(!ok)
+		return -1;
+	st->device=info.dwVolumeSerialNumber;
+	st->inode=(uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+	st->size=(uint64_t)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+	/*100ns ticks*/
+	st->mtime=(int64_t)((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime);
+	/*FAT keeps times to 2 seconds*/
+	GetSystemTimeAsFileTime(&now);
+	st->recent=(st->mtime >= (int64_t)((uint64_t)now.dwHighDateTime << 32 | now.dwLowDateTime) - 20000000);
+	return 0;
+}
+
+int wing_place(const char *path, struct wing_place *pl)
+{
+	BY_HANDLE_FILE_INFORMATION info;
+	STARTING_VCN_INPUT_BUFFER from;
+	RETRIEVAL_POINTERS_BUFFER runs;
+	DWORD got;
+	HANDLE h;
+
+	h=CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	if(h == INVALID_HANDLE_VALUE)
+	{
+		set_errno(GetLastError());
+		return -1;
+	}
+	if(!GetFileInformationByHandle(h, &info))
+	{
+		set_errno(GetLastError());
+		CloseHandle(h);
+		return -1;
+	}
+	pl->device=info.dwVolumeSerialNumber;
+	pl->address=(uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow;
+	pl->exact=0;
+	/*Only the first run is wanted, so there being more isn't an error.
+	  Files small enough to live in the MFT have none; sparse runs
+	  have no cluster*/
+	from.StartingVcn.QuadPart=0;
+	if((DeviceIoControl(h, FSCTL_GET_RETRIEVAL_POINTERS, &from, sizeof from, &runs, sizeof runs, &got, NULL)
+		|| GetLastError() == ERROR_MORE_DATA) && runs.ExtentCount > 0 && runs.Extents[0].Lcn.QuadPart >= 0)
+	{
+		pl->address=(uint64_t)runs.Extents[0].Lcn.QuadPart;
+		pl->exact=1;
+	}
+	CloseHandle(h);
+	return 0;
+}
+
+FILE *wing_replace_open(const char *path, char **tmp)
+{
+	static volatile LONG counter;
+	FILE *f;
+	int fd;
+	int tries;
+
+	if((*tmp=malloc(strlen(path) + 32)) == NULL)
+		return NULL;
+	/*The process and a count make the name; a clash with another
+	  process that had the same id is only a reason to try again*/
+	for(tries=0; ; tries++)
+	{
+		sprintf(*tmp, "%s.%lu.%ld", path, (unsigned long)GetCurrentProcessId(),
+			(long)InterlockedIncrement(&counter));
+		if((fd=_open(*tmp, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE)) >= 0)
+			break;
+		if(errno != EEXIST || tries >= 100)
+		{
+			int errno_save=errno;
+			free(*tmp);
+			errno=errno_save;
+			return NULL;
+		}
+	}
+	if((f=_fdopen(fd, "wb")) == NULL)
+	{
+		int errno_save=errno;
+		_close(fd);
+		remove(*tmp);
+		free(*tmp);
+		errno=errno_save;
+		return NULL;
+	}
+	return f;
+}
+
+int wing_replace(const char *tmp, const char *path)
+{
+	/*rename won't replace a file here, and removing it first would
+	  leave a moment with no file at all*/
+	if(!MoveFileEx(tmp, path, MOVEFILE_REPLACE_EXISTING))
+	{
+		set_errno(GetLastError());
+		return -1;
+	}
+	return 0;
+}
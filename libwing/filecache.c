@@ -0,0 +1,483 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filecache.h"
+#include "libwing.h"
+#include "openbsd.h"
+
+/*Cache files of results.
+
+  A file is a header, the records, then an index of them sorted by a
+    hash of the file name and query.  Each index entry also says which
+    run last used its record, counting runs that wrote the file, and
+    when the file gets too big it's the records with the oldest of those
+    that go.
+  As with the pattern cache, the file is in the host's own byte order
+    and layout, one that doesn't look exactly right is ignored, and it's
+    replaced by renaming a complete new one over it.
+*/
+#define CACHE_VERSION 1
+static const char cache_magic[8]="WFCACHE";
+#define BYTE_ORDER_MARK 0x01020304UL
+
+#define ALIGN(n) (((uint64_t)(n) + 7) & ~(uint64_t)7)
+
+struct cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t nentries;
+	uint32_t pad;
+	uint64_t generation;	/*of the run that wrote it*/
+	uint64_t index;	/*offset of struct cache_index[nentries]*/
+};
+
+struct cache_index
+{
+	uint64_t key;	/*cache_key() of name and query*/
+	uint64_t offset;	/*of the cache_record*/
+	uint64_t size;	/*of the record and everything after it*/
+	uint64_t used;	/*generation that last used it; 0 once it's been replaced*/
+	uint64_t check;	/*hash of the size bytes of the record*/
+};
+
+/*Followed by the name and the query, each with a NUL, then the result*/
+struct cache_record
+{
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtime;
+	uint64_t datalen;
+	uint32_t namelen;
+	uint32_t querylen;
+};
+
+/*A result added since the file was opened*/
+struct pending
+{
+	struct pending *next;	/*next older*/
+	struct pending *chain;	/*in the same hash bucket*/
+	struct cache_index ent;	/*offset is not known yet*/
+	uint64_t data[];	/*the record, ent.size bytes*/
+};
+
+struct filecache
+{
+	char *path;
+	uint64_t limit;
+	struct wing_mutex *lock;
+	struct wing_map map;
+	const struct cache_index *index;	/*into map; NULL if the file is unusable*/
+	uint32_t nentries;
+	uint64_t *used;	/*for each entry in index, as it is now*/
+	uint64_t generation;	/*of this run*/
+	struct pending *pending;	/*newest first*/
+	uint32_t npending;
+	uint64_t pending_bytes;
+	struct pending **buckets;	/*pending, hashed by key*/
+	uint32_t nbuckets;
+	int changed;	/*there's something to write out*/
+};
+
+#define FNV_INIT 14695981039346656037ULL
+
+static uint64_t fnv(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s=p;
+	while(len-- > 0)
+	{
+		h ^= *s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t cache_key(const char *name, const char *query)
+{
+	return fnv(fnv(FNV_INIT, name, strlen(name)+1), query, strlen(query));
+}
+
+/*Checksum of a record, a word at a time; they're aligned and padded*/
+static uint64_t record_check(const void *record, uint64_t size)
+{
+	const uint64_t *w=record;
+	uint64_t h=FNV_INIT;
+	uint64_t i;
+
+	for(i=0; i < size/8; i++)
+		h=(h ^ w[i]) * 1099511628211ULL;
+	return h;
+}
+
+static uint64_t record_size(uint64_t namelen, uint64_t querylen, uint64_t datalen)
+{
+	return ALIGN(sizeof(struct cache_record) + namelen + 1 + querylen + 1 + datalen);
+}
+
+/*Returns the record ent refers to if it lies within the mapped file and
+  passes every check, or NULL*/
+static const struct cache_record *checked_record(const filecache_t *fc, const struct cache_index *ent)
+{
+	const struct cache_record *r;
+	const char *base;
+
+	if(ent->offset % 8 != 0 || ent->offset > fc->map.len
+		|| fc->map.len - ent->offset < ent->size || ent->size < sizeof *r)
+		return NULL;
+	base=fc->map.data + ent->offset;
+	r=(const struct cache_record *)base;
+	if(r->datalen > ent->size || record_size(r->namelen, r->querylen, r->datalen) != ent->size
+		|| record_check(base, ent->size) != ent->check)
+		return NULL;
+	if(base[sizeof *r + r->namelen] != '\0' || base[sizeof *r + r->namelen + 1 + r->querylen] != '\0')
+		return NULL;
+	return r;
+}
+
+/*Returns nonzero if r is the result of query on name*/
+static int record_is(const struct cache_record *r, const char *name, const char *query)
+{
+	const char *base=(const char *)r + sizeof *r;
+	return strcmp(base, name) == 0 && strcmp(base + r->namelen + 1, query) == 0;
+}
+
+static int record_matches(const struct cache_record *r, const struct wing_stamp *stamp)
+{
+	return r->device == stamp->device && r->inode == stamp->inode && r->size == stamp->size && r->mtime == stamp->mtime;
+}
+
+static const char *record_data(const struct cache_record *r)
+{
+	return (const char *)r + sizeof *r + r->namelen + 1 + r->querylen + 1;
+}
+
+/*Finds the live result for name and query, in the file or among those
+  added since.  Returns NULL if there is none, or else points *used at
+  its generation.
+*/
+static const struct cache_record *lookup(filecache_t *fc, uint64_t key, const char *name, const char *query, uint64_t **used)
+{
+	const struct cache_record *r;
+	struct pending *pe;
+	uint32_t lo=0, hi=fc->nentries, mid;
+
+	/*Newer results replace older ones, so look at those first*/
+	if(fc->nbuckets > 0)
+		for(pe=fc->buckets[key % fc->nbuckets]; pe != NULL; pe=pe->chain)
+			if(pe->ent.key == key && pe->ent.used != 0 && record_is((const struct cache_record *)pe->data, name, query))
+			{
+				*used=&pe->ent.used;
+				return (const struct cache_record *)pe->data;
+			}
+
+	while(lo < hi)
+	{
+		mid=lo + (hi-lo)/2;
+		if(fc->index[mid].key < key)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	for(; lo < fc->nentries && fc->index[lo].key == key; lo++)
+		if(fc->used[lo] != 0 && (r=checked_record(fc, &fc->index[lo])) != NULL && record_is(r, name, query))
+		{
+			*used=&fc->used[lo];
+			return r;
+		}
+	return NULL;
+}
+
+/*Returns nonzero if the mapped file is one we can use*/
+static int use_file(filecache_t *fc)
+{
+	const struct cache_header *h=(const struct cache_header *)fc->map.data;
+	uint32_t i;
+
+	if(fc->map.len < sizeof *h)
+		return 0;
+	if(memcmp(h->magic, cache_magic, sizeof h->magic) != 0 || h->version != CACHE_VERSION
+		|| h->byteorder != BYTE_ORDER_MARK)
+		return 0;
+	if(h->index % 8 != 0 || h->index > fc->map.len
+		|| (fc->map.len - h->index) / sizeof *fc->index < h->nentries)
+		return 0;
+	if((fc->used=reallocarray(NULL, h->nentries ? h->nentries : 1, sizeof *fc->used)) == NULL)
+		return 0;
+	fc->index=(const struct cache_index *)(fc->map.data + h->index);
+	fc->nentries=h->nentries;
+	for(i=0; i < fc->nentries; i++)
+		fc->used[i]=fc->index[i].used;
+	fc->generation=h->generation + 1;
+	return 1;
+}
+
+filecache_t *filecache_open(const char *path, uint64_t limit)
+{
+	filecache_t *fc;
+	FILE *f;
+
+	if((fc=calloc(1, sizeof *fc)) == NULL)
+		return NULL;
+	if((fc->path=malloc(strlen(path)+1)) == NULL || (fc->lock=wing_mutex_new()) == NULL)
+	{
+		free(fc->path);
+		free(fc);
+		return NULL;
+	}
+	strcpy(fc->path, path);
+	fc->limit=limit;
+	fc->generation=1;
+
+	if((f=fopen(path, "rb")) != NULL)
+	{
+		if(wing_map(f, &fc->map) == 0 && !use_file(fc))
+			wing_unmap(&fc->map);
+		fclose(f);
+	}
+	return fc;
+}
+
+int filecache_find(filecache_t *fc, const char *name, const struct wing_stamp *stamp, const char *query,
+	const char **data, size_t *len)
+{
+	const struct cache_record *r;
+	uint64_t *used;
+	int found=0;
+
+	wing_mutex_lock(fc->lock);
+	if((r=lookup(fc, cache_key(name, query), name, query, &used)) != NULL && record_matches(r, stamp)
+		&& r->datalen <= SIZE_MAX)
+	{
+		*data=record_data(r);
+		*len=(size_t)r->datalen;
+		*used=fc->generation;
+		found=1;
+	}
+	wing_mutex_unlock(fc->lock);
+	return found;
+}
+
+/*Doubles the pending hash table.  Returns 0 if memory runs out.*/
+static int grow_buckets(filecache_t *fc)
+{
+	uint32_t n=fc->nbuckets == 0 ? 64 : fc->nbuckets * 2;
+	struct pending **b;
+	struct pending *pe;
+
+	if((b=calloc(n, sizeof *b)) == NULL)
+		return 0;
+	for(pe=fc->pending; pe != NULL; pe=pe->next)
+	{
+		pe->chain=b[pe->ent.key % n];
+		b[pe->ent.key % n]=pe;
+	}
+	free(fc->buckets);
+	fc->buckets=b;
+	fc->nbuckets=n;
+	return 1;
+}
+
+void filecache_add(filecache_t *fc, const char *name, const struct wing_stamp *stamp, const char *query,
+	const char *data, size_t len)
+{
+	struct cache_record r;
+	struct pending *pe;
+	uint64_t key=cache_key(name, query);
+	uint64_t size;
+	uint64_t *used;
+	size_t namelen=strlen(name), querylen=strlen(query);
+	char *base;
+
+	if(stamp->recent || namelen > UINT32_MAX || querylen > UINT32_MAX)
+		return;
+	size=record_size(namelen, querylen, len);
+	if(size + sizeof(struct cache_header) + sizeof(struct cache_index) > fc->limit || size > SIZE_MAX - sizeof *pe)
+		return;
+
+	memset(&r, 0, sizeof r);
+	r.device=stamp->device;
+	r.inode=stamp->inode;
+	r.size=stamp->size;
+	r.mtime=stamp->mtime;
+	r.datalen=len;
+	r.namelen=(uint32_t)namelen;
+	r.querylen=(uint32_t)querylen;
+
+	wing_mutex_lock(fc->lock);
+	/*What's added is held in memory until it's written, so no more than
+	  would fit in the file*/
+	if(fc->pending_bytes + size > fc->limit || (fc->npending >= fc->nbuckets && !grow_buckets(fc) && fc->nbuckets == 0)
+		|| (pe=malloc(sizeof *pe + (size_t)size)) == NULL)
+	{
+		wing_mutex_unlock(fc->lock);
+		return;
+	}
+	if(lookup(fc, key, name, query, &used) != NULL)
+		*used=0;
+
+	/*Zero the padding too, so files come out the same every time*/
+	base=(char *)pe->data;
+	memset(base, 0, (size_t)size);
+	memcpy(base, &r, sizeof r);
+	memcpy(base + sizeof r, name, namelen);
+	memcpy(base + sizeof r + namelen + 1, query, querylen);
+	memcpy(base + sizeof r + namelen + 1 + querylen + 1, data, len);
+
+	pe->ent.key=key;
+	pe->ent.offset=0;
+	pe->ent.size=size;
+	pe->ent.used=fc->generation;
+	pe->ent.check=record_check(base, size);
+	pe->chain=fc->buckets[key % fc->nbuckets];
+	fc->buckets[key % fc->nbuckets]=pe;
+	pe->next=fc->pending;
+	fc->pending=pe;
+	fc->npending++;
+	fc->pending_bytes+=size;
+	fc->changed=1;
+	wing_mutex_unlock(fc->lock);
+}
+
+/*A record to be written out, and where it comes from*/
+struct source
+{
+	struct cache_index ent;
+	const char *data;
+};
+
+/*Most recently used first*/
+static int by_use(const void *va, const void *vb)
+{
+	const struct source *a=va, *b=vb;
+	return (a->ent.used < b->ent.used) - (a->ent.used > b->ent.used);
+}
+
+static int by_key(const void *va, const void *vb)
+{
+	const struct source *a=va, *b=vb;
+	return (a->ent.key > b->ent.key) - (a->ent.key < b->ent.key);
+}
+
+/*Writes the live records, most recently used first, as many as fit in
+    the limit, then the index.
+  Returns 0 on success, -1 on error.
+*/
+static int write_cache(filecache_t *fc, FILE *out)
+{
+	struct cache_header h;
+	struct source *src;
+	const struct pending *pe;
+	uint32_t n=0, keep, i;
+	uint64_t offset, total;
+
+	if((src=reallocarray(NULL, fc->nentries + (size_t)fc->npending + 1, sizeof *src)) == NULL)
+		return -1;
+	for(i=0; i < fc->nentries; i++)
+		if(fc->used[i] != 0 && checked_record(fc, &fc->index[i]) != NULL)
+		{
+			src[n].ent=fc->index[i];
+			src[n].ent.used=fc->used[i];
+			src[n].data=fc->map.data + fc->index[i].offset;
+			n++;
+		}
+	for(pe=fc->pending; pe != NULL; pe=pe->next)
+		if(pe->ent.used != 0)
+		{
+			src[n].ent=pe->ent;
+			src[n].data=(const char *)pe->data;
+			n++;
+		}
+	qsort(src, n, sizeof *src, by_use);
+
+	total=sizeof h;
+	for(keep=0; keep < n; keep++)
+	{
+		if(total > fc->limit || fc->limit - total < src[keep].ent.size + sizeof src[keep].ent)
+			break;
+		total+=src[keep].ent.size + sizeof src[keep].ent;
+	}
+
+	offset=sizeof h;
+	for(i=0; i < keep; i++)
+	{
+		src[i].ent.offset=offset;
+		offset+=src[i].ent.size;
+	}
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, cache_magic, sizeof h.magic);
+	h.version=CACHE_VERSION;
+	h.byteorder=BYTE_ORDER_MARK;
+	h.nentries=keep;
+	h.generation=fc->generation;
+	h.index=offset;
+	fwrite(&h, sizeof h, 1, out);
+	for(i=0; i < keep; i++)
+		fwrite(src[i].data, 1, (size_t)src[i].ent.size, out);
+	qsort(src, keep, sizeof *src, by_key);
+	for(i=0; i < keep; i++)
+		fwrite(&src[i].ent, sizeof src[i].ent, 1, out);
+
+	free(src);
+	return ferror(out) ? -1 : 0;
+}
+
+/*Writes a new file next to the old one, and renames it into place.
+  Unmaps the old file whatever happens.
+*/
+static int replace_file(filecache_t *fc)
+{
+	char *tmp;
+	FILE *out;
+	int errno_save=0;
+
+	if((out=wing_replace_open(fc->path, &tmp)) == NULL)
+	{
+		errno_save=errno;
+		wing_unmap(&fc->map);
+		errno=errno_save;
+		return -1;
+	}
+	errno=0;
+	if(write_cache(fc, out) != 0)
+		errno_save=errno ? errno : EIO;
+	if(fclose(out) != 0 && errno_save == 0)
+		errno_save=errno ? errno : EIO;
+
+	/*Win32 can't replace a file that is mapped*/
+	wing_unmap(&fc->map);
+	if(errno_save == 0 && wing_replace(tmp, fc->path) != 0)
+		errno_save=errno;
+	if(errno_save != 0)
+		remove(tmp);
+	free(tmp);
+	errno=errno_save;
+	return errno_save == 0 ? 0 : -1;
+}
+
+int filecache_close(filecache_t *fc)
+{
+	struct pending *pe, *next;
+	int ret=0;
+
+	if(fc->changed)
+		ret=replace_file(fc);
+	else
+		wing_unmap(&fc->map);
+	for(pe=fc->pending; pe != NULL; pe=next)
+	{
+		next=pe->next;
+		free(pe);
+	}
+	wing_mutex_free(fc->lock);
+	free(fc->buckets);
+	free(fc->used);
+	free(fc->path);
+	free(fc);
+	return ret;
+}
@@ -0,0 +1,61 @@
+#ifndef H_LIBWING_FILECACHE
+#define H_LIBWING_FILECACHE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libwing.h"
+
+/*A file of results worked out from other files, kept between runs so
+    that asking the same question of files that haven't changed needn't
+    read them again.
+  A result is filed under the name of the file and a query string, and
+    only holds while the file's stamp is what it was when the result was
+    worked out.  What a query string means is up to the caller; the
+    cache only compares them.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct filecache filecache_t;
+
+/*Opens the cache file at path, which is to hold at most limit bytes.
+    A missing, unreadable, damaged or out-of-date file is not an error;
+    the cache just starts out empty.
+  Returns NULL only if memory runs out.
+*/
+filecache_t *filecache_open(const char *path, uint64_t limit);
+
+/*Looks for the result of query on the file name, which had better have
+    been stamped before it was read.  Leaves the result in *data and
+    *len, valid until the cache is closed.
+  Returns 1 if it was found, or 0.
+  Can be called from several threads at once, as can filecache_add.
+*/
+int filecache_find(filecache_t *fc, const char *name, const struct wing_stamp *stamp, const char *query,
+	const char **data, size_t *len);
+
+/*Files the len bytes at data as the result of query on name, replacing
+    any result it had before, to be written out by filecache_close.
+    Results for recent files, or too big to keep at all, are passed up.
+  Caching is an optimization, so nothing is said if this fails.
+*/
+void filecache_add(filecache_t *fc, const char *name, const struct wing_stamp *stamp, const char *query,
+	const char *data, size_t len);
+
+/*Writes out the cache, if anything was added, and frees it.  When it's
+    too big, the results that have gone unused longest are dropped.
+    A run that only finds results doesn't write the file, and so doesn't
+    count as having used them.
+  Returns 0 on success, or -1 with errno set if the file couldn't be
+    written.  The cache is freed either way.
+*/
+int filecache_close(filecache_t *fc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/*H_LIBWING_FILECACHE #include guard*/
@@ -1,6 +1,10 @@
 #ifndef H_LIBWING_LIBWING
 #define H_LIBWING_LIBWING
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
 /*Some useful things*/
 
 #ifdef __cplusplus
@@ -19,6 +23,203 @@ extern "C" {
 */
 int wing_glob_foreach(const char *pattern, int (*func)(const char *name, void *env), void *env);
 
+/*A read-only view of the whole of a file*/
+struct wing_map
+{
+	const char *data;	/*NULL if len is 0*/
+	size_t len;
+};
+
+/*Maps the whole of the open file f (regardless of its current position)
+    read-only into memory.
+  Returns 0 on success.  The mapping stays valid after f is closed, until
+    it is passed to wing_unmap.  An empty file maps successfully, with
+    data == NULL.
+  Returns -1 if the file can't be mapped: it isn't a regular file, it
+    doesn't fit in the address space, or the platform can't map files.
+    errno describes the problem.  Callers are expected to fall back to
+    reading the file with stdio.
+*/
+int wing_map(FILE *f, struct wing_map *m);
+
+/*Hints that m is about to be read once, front to back, so the system
+    can read ahead aggressively and drop pages behind the reader.
+  Only a hint; does nothing where there's no way to give it.
+*/
+void wing_map_sequential(struct wing_map *m);
+
+/*Releases a mapping made by wing_map*/
+void wing_unmap(struct wing_map *m);
+
+/*Sparse files have holes, which read as nuls but aren't stored, so
+    there's nothing to be had from reading them.
+  Finds the first stretch of stored data at or after offset from in the
+    open file f (wherever its current position is, which is left alone),
+    and sets *start and *end to where it begins and ends.
+  Returns 1 if there is one, or 0 if the rest of the file is a hole.
+    Returns -1 with errno set if the system can't tell, in which case
+    the rest of the file is best taken to be data.
+*/
+int wing_find_data(FILE *f, uint64_t from, uint64_t *start, uint64_t *end);
+
+/*Reads up to n bytes of the open file f into buf, as read(2) does:
+    once any input has come, it's taken without waiting for the rest,
+    so a pipe is read as fast as it's written to.  This goes around f's
+    stdio buffer, so f mustn't have been read with stdio.
+  Sets *got to how many bytes were read, 0 at the end of the file.
+  Returns 0 on success, or -1 with errno set on a read error.
+*/
+int wing_read(FILE *f, void *buf, size_t n, size_t *got);
+
+/*Hints that the first len bytes of the file at path will be read soon,
+    so the system can start reading them in now.
+  Only a hint; does nothing where there's no way to give it.
+*/
+void wing_prefetch(const char *path, size_t len);
+
+/*Reading directories.  The entry types are only as good as the
+    platform can tell without following symbolic links; those, and
+    anything else that's neither a regular file nor a directory, are
+    WING_DT_OTHER.
+*/
+struct wing_dir;
+
+#define WING_DT_OTHER	0
+#define WING_DT_FILE	1
+#define WING_DT_DIR	2
+
+/*Opens the directory at path.
+  Returns NULL with errno set if it can't be opened (or isn't one).
+*/
+struct wing_dir *wing_opendir(const char *path);
+
+/*Gets the next entry of d, skipping . and ..
+  *name stays valid until the next call; *type is a WING_DT_ value.
+  Returns 1 for an entry, 0 at the end, or -1 with errno set.
+*/
+int wing_readdir(struct wing_dir *d, const char **name, int *type);
+
+void wing_closedir(struct wing_dir *d);
+
+/*Enough about a file to tell whether it has changed since: which file
+    it is, its size, and when it was last modified, in whatever units
+    the platform keeps that in.
+  A file modified so lately that it could be changed again within the
+    same tick of that clock is recent; its stamp can't be trusted to
+    show a change made after it was taken.
+*/
+struct wing_stamp
+{
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtime;
+	int recent;
+};
+
+/*Fills in *st for the file at path, following symbolic links.
+  Returns 0 on success, or -1 with errno set.
+*/
+int wing_stamp(const char *path, struct wing_stamp *st);
+
+/*Where a file lies on disk, as near as the system will say.  Reading
+    files in this order, device by device, saves a spinning disk from
+    seeking back and forth.
+  The address is where the file's first block is, in whatever units the
+    platform gives, if exact is set.  Otherwise (the filesystem won't
+    say, or the file has no blocks) it's the file's inode number or
+    file index, which filesystems tend to hand out in the order they
+    place files.
+*/
+struct wing_place
+{
+	uint64_t device;
+	uint64_t address;
+	int exact;
+};
+
+/*Fills in *pl for the file at path, following symbolic links.
+  Returns 0 on success, or -1 with errno set.
+*/
+int wing_place(const char *path, struct wing_place *pl);
+
+/*Replacing a file all at once, so that whoever opens it gets either
+    the old one or the new one, never part of each: the new contents
+    go in a file of their own next to it, which is renamed over it.
+  wing_replace_open creates that file, under a name no other process
+    will pick, and puts the name in *tmp, to be freed by the caller.
+    Returns the file open for writing, or NULL with errno set.
+*/
+FILE *wing_replace_open(const char *path, char **tmp);
+
+/*Renames the file tmp, made by wing_replace_open and since closed, over
+    path.  Win32 can't do that to a file that's mapped.
+  Returns 0 on success, or -1 with errno set, in which case tmp is still
+    there for the caller to remove.
+*/
+int wing_replace(const char *tmp, const char *path);
+
+/*Reading many small files at once.  Where the system allows it
+    (io_uring on Linux), the opens, reads and closes for a whole batch
+    are each handed over in a single call; elsewhere they're done one
+    file after another.
+*/
+struct wing_batch;
+
+struct wing_batch_file
+{
+	const char *path;
+	const char *data;	/*the whole file, or NULL if it wasn't read*/
+	size_t len;
+	int err;	/*errno if it couldn't be opened, or 0*/
+};
+
+/*Returns a batch reader for up to nfiles files of up to maxlen bytes
+    each, or NULL if memory runs out.
+*/
+struct wing_batch *wing_batch_new(size_t nfiles, size_t maxlen);
+
+/*Reads the first n (up to nfiles) of the files, by path.  Regular files
+    of up to maxlen bytes get their data and len, which stay valid until
+    the next call; the rest are left for reading the usual way, unless
+    err is set.
+*/
+void wing_batch_read(struct wing_batch *b, struct wing_batch_file *files, size_t n);
+
+void wing_batch_free(struct wing_batch *b);
+
+/*Threads, locks and condition variables; just enough for worker pools.
+  The objects are opaque, and the functions that make them return NULL
+    if they can't.
+*/
+struct wing_thread;
+struct wing_mutex;
+struct wing_cond;
+
+/*Runs func(arg) in a new thread*/
+struct wing_thread *wing_thread_start(void (*func)(void *arg), void *arg);
+
+/*Waits for t to finish, and frees it*/
+void wing_thread_join(struct wing_thread *t);
+
+struct wing_mutex *wing_mutex_new(void);
+void wing_mutex_lock(struct wing_mutex *m);
+void wing_mutex_unlock(struct wing_mutex *m);
+void wing_mutex_free(struct wing_mutex *m);
+
+struct wing_cond *wing_cond_new(void);
+/*Unlocks m, waits for c to be broadcast, then locks m again.  Can wake
+    up for no reason, so check the condition again.
+*/
+void wing_cond_wait(struct wing_cond *c, struct wing_mutex *m);
+void wing_cond_broadcast(struct wing_cond *c);
+void wing_cond_free(struct wing_cond *c);
+
+/*Returns the number of processors this process can run on, or 1 if
+    that can't be found out.
+*/
+int wing_ncpus(void);
+
 #ifdef __cplusplus
 }
 #endif
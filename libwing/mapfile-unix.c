@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200112L
+/*SEEK_DATA and SEEK_HOLE, on glibc*/
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "libwing.h"
+
+int wing_map(FILE *f, struct wing_map *m)
+{
+	struct stat st;
+	void *p;
+	int fd=fileno(f);
+
+	if(fstat(fd, &st) != 0)
+		return -1;
+	if(!S_ISREG(st.st_mode))
+	{
+		errno=ENODEV;
+		return -1;
+	}
+	if((uintmax_t)st.st_size > SIZE_MAX)
+	{
+		errno=EFBIG;
+		return -1;
+	}
+
+	m->data=NULL;
+	m->len=(size_t)st.st_size;
+	if(m->len == 0)
+		return 0;	/*mmap refuses zero-length mappings*/
+	p=mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(p == MAP_FAILED)
+		return -1;
+	m->data=p;
+	return 0;
+}
+
+void wing_map_sequential(struct wing_map *m)
+{
+	if(m->data != NULL)
+		posix_madvise((void *)m->data, m->len, POSIX_MADV_SEQUENTIAL);
+}
+
+void wing_prefetch(const char *path, size_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+	/*Opening a fifo would block, and reading ahead means nothing to it*/
+	int fd=open(path, O_RDONLY | O_NONBLOCK);
+
+	if(fd < 0)
+		return;
+	/*The pages stay in the cache after it's closed*/
+	posix_fadvise(fd, 0, (off_t)len, POSIX_FADV_WILLNEED);
+	close(fd);
+#else
+	(void)path;
+	(void)len;
+#endif
+}
+
+int wing_read(FILE *f, void *buf, size_t n, size_t *got)
+{
+	ssize_t r;
+
+	/*read can't say it read more than this*/
+	if(n > SSIZE_MAX)
+		n=SSIZE_MAX;
+	while((r=read(fileno(f), buf, n)) < 0 && errno == EINTR)
+		;
+	*got=(r > 0) ? (size_t)r : 0;
+	return (r < 0) ? -1 : 0;
+}
+
+int wing_find_data(FILE *f, uint64_t from, uint64_t *start, uint64_t *end)
+{
+#ifdef SEEK_DATA
+	int fd=fileno(f);
+	off_t was=lseek(fd, 0, SEEK_CUR);
+	off_t data, hole;
+	int errno_save;
+	int ret=1;
+
+	if(was < 0)
+		return -1;
+	if((off_t)from < 0 || (uint64_t)(off_t)from != from)
+	{
+		errno=EOVERFLOW;
+		return -1;
+	}
+	/*Past the last of the data is ENXIO, just as past the end is*/
+	if((data=lseek(fd, (off_t)from, SEEK_DATA)) < 0)
+		ret=(errno == ENXIO) ? 0 : -1;
+	/*There's always a hole at the end, if only after it*/
+	else if((hole=lseek(fd, data, SEEK_HOLE)) < 0)
+		ret=-1;
+	else
+	{
+		*start=(uint64_t)data;
+		*end=(uint64_t)hole;
+	}
+	errno_save=errno;
+	lseek(fd, was, SEEK_SET);
+	errno=errno_save;
+	return ret;
+#else
+	(void)f;
+	(void)from;
+	(void)start;
+	(void)end;
+	errno=ENOSYS;
+	return -1;
+#endif
+}
+
+void wing_unmap(struct wing_map *m)
+{
+	if(m->data != NULL)
+		munmap((void *)m->data, m->len);
+	m->data=NULL;
+	m->len=0;
+}
@@ -0,0 +1,121 @@
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+
+#include "libwing.h"
+
+int wing_map(FILE *f, struct wing_map *m)
+{
+	HANDLE file=(HANDLE)_get_osfhandle(_fileno(f));
+	HANDLE mapping;
+	LARGE_INTEGER size;
+	void *p;
+
+	if(file == INVALID_HANDLE_VALUE || GetFileType(file) != FILE_TYPE_DISK)
+	{
+		errno=ENODEV;
+		return -1;
+	}
+	if(!GetFileSizeEx(file, &size))
+	{
+		errno=EIO;
+		return -1;
+	}
+	if((unsigned long long)size.QuadPart > (size_t)-1)
+	{
+		errno=EFBIG;
+		return -1;
+	}
+
+	m->data=NULL;
+	m->len=(size_t)size.QuadPart;
+	if(m->len == 0)
+		return 0;	/*CreateFileMapping refuses empty files*/
+	mapping=CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping == NULL)
+	{
+		errno=EACCES;
+		return -1;
+	}
+	p=MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	/*The view keeps the mapping object alive on its own*/
+	CloseHandle(mapping);
+	if(p == NULL)
+	{
+		errno=ENOMEM;
+		return -1;
+	}
+	m->data=p;
+	return 0;
+}
+
+void wing_map_sequential(struct wing_map *m)
+{
+	/*Views have no access-pattern advice; the cache manager's own
+	  read-ahead notices sequential faults anyway*/
+	(void)m;
+}
+
+void wing_prefetch(const char *path, size_t len)
+{
+	/*There's no asking for a file to be read in without reading it*/
+	(void)path;
+	(void)len;
+}
+
+int wing_read(FILE *f, void *buf, size_t n, size_t *got)
+{
+	int r;
+
+	if(n > INT_MAX)
+		n=INT_MAX;
+	/*In text mode, this turns CRLF into LF as stdio would*/
+	r=_read(_fileno(f), buf, (unsigned int)n);
+	*got=(r > 0) ? (size_t)r : 0;
+	return (r < 0) ? -1 : 0;
+}
+
+int wing_find_data(FILE *f, uint64_t from, uint64_t *start, uint64_t *end)
+{
+	HANDLE file=(HANDLE)_get_osfhandle(_fileno(f));
+	FILE_ALLOCATED_RANGE_BUFFER query, range;
+	LARGE_INTEGER size;
+	DWORD got;
+
+	if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+	{
+		errno=EIO;
+		return -1;
+	}
+	if(from >= (uint64_t)size.QuadPart)
+		return 0;
+	/*Only the first range is wanted, so there being more isn't an
+	  error.  Files that aren't sparse are one range all the way*/
+	query.FileOffset.QuadPart=(LONGLONG)from;
+	query.Length.QuadPart=size.QuadPart - (LONGLONG)from;
+	if(!DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof query, &range, sizeof range, &got, NULL)
+		&& GetLastError() != ERROR_MORE_DATA)
+	{
+		errno=ENOSYS;
+		return -1;
+	}
+	if(got < sizeof range)
+		return 0;
+	*start=(uint64_t)range.FileOffset.QuadPart;
+	*end=*start + (uint64_t)range.Length.QuadPart;
+	if(*start < from)
+		*start=from;
+	return 1;
+}
+
+void wing_unmap(struct wing_map *m)
+{
+	if(m->data != NULL)
+		UnmapViewOfFile(m->data);
+	m->data=NULL;
+	m->len=0;
+}
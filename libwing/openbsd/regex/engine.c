@@ -84,7 +84,8 @@ struct match {
 	states empty;		/* empty set of states */
 };
 
-static int matcher(struct re_guts *, char *, size_t, regmatch_t[], int);
+static int matcher(struct re_guts *, char *, char *, char *, char *, size_t,
+    regmatch_t[], int);
 static char *dissect(struct match *, char *, char *, sopno, sopno);
 static char *backref(struct match *, char *, char *, sopno, sopno, sopno, int);
 static char *fast(struct match *, char *, char *, sopno, sopno);
@@ -124,10 +125,15 @@ static int nope = 0;
 
 /*
  - matcher - the actual matching engine
+ *
+ * Offsets are reported relative to string; begin is where the virtual
+ * NUL preceding the string lives, and the search starts at start, which
+ * the prescreen in regexec() may have moved past begin.  REG_NOSUB has
+ * been dealt with by the caller: nmatch is how much the caller wants.
  */
 static int			/* 0 success, REG_NOMATCH failure */
-matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pmatch[],
-    int eflags)
+matcher(struct re_guts *g, char *string, char *begin, char *start, char *stop,
+    size_t nmatch, regmatch_t pmatch[], int eflags)
 {
 	char *endp;
 	size_t i;
@@ -136,31 +142,6 @@ matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pmatch[],
 	char *dp;
 	const sopno gf = g->firststate+1;	/* +1 for OEND */
 	const sopno gl = g->laststate;
-	char *start;
-	char *stop;
-
-	/* simplify the situation where possible */
-	if (g->cflags&REG_NOSUB)
-		nmatch = 0;
-	if (eflags&REG_STARTEND) {
-		start = string + pmatch[0].rm_so;
-		stop = string + pmatch[0].rm_eo;
-	} else {
-		start = string;
-		stop = start + strlen(start);
-	}
-	if (stop < start)
-		return(REG_INVARG);
-
-	/* prescreening; this does wonders for this rather slow code */
-	if (g->must != NULL) {
-		for (dp = start; dp < stop; dp++)
-			if (*dp == g->must[0] && stop - dp >= g->mlen &&
-				memcmp(dp, g->must, (size_t)g->mlen) == 0)
-				break;
-		if (dp == stop)		/* we didn't find g->must */
-			return(REG_NOMATCH);
-	}
 
 	/* match struct setup */
 	m->g = g;
@@ -168,7 +149,7 @@ matcher(struct re_guts *g, char *string, size_t nmatch, regmatch_t pmatch[],
 	m->pmatch = NULL;
 	m->lastpos = NULL;
 	m->offp = string;
-	m->beginp = start;
+	m->beginp = begin;
 	m->endp = stop;
 	STATESETUP(m, 4);
 	SETUP(m->st);
@@ -680,6 +661,8 @@ fast(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 	int c = (start == m->beginp) ? OUT : *(start-1);
 	int lastc;	/* previous c */
 	int flagch;
+	int boleol;		/* BOL/EOL flag here, and its steps */
+	int nboleol;
 	int i;
 	char *coldp;	/* last p after which no match was underway */
 
@@ -693,8 +676,12 @@ fast(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 		/* next character */
 		lastc = c;
 		c = (p == m->endp) ? OUT : *p;
-		if (EQ(st, fresh))
+		if (EQ(st, fresh)) {
 			coldp = p;
+			/* nothing underway, and nothing can start now */
+			if (p > start && (m->g->iflags&ANCHOR))
+				break;		/* NOTE BREAK OUT */
+		}
 
 		/* is there an EOL and/or BOL between lastc and c? */
 		flagch = '\0';
@@ -709,6 +696,8 @@ fast(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 			flagch = (flagch == BOL) ? BOLEOL : EOL;
 			i += m->g->neol;
 		}
+		boleol = flagch;
+		nboleol = i;
 		if (i != 0) {
 			for (; i > 0; i--)
 				st = step(m->g, startst, stopst, st, flagch, st);
@@ -727,6 +716,9 @@ fast(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 		if (flagch == BOW || flagch == EOW) {
 			st = step(m->g, startst, stopst, st, flagch, st);
 			SP("boweow", st, c);
+			/* and again, for a ^ or $ after the \< or \> */
+			for (i = nboleol; i > 0; i--)
+				st = step(m->g, startst, stopst, st, boleol, st);
 		}
 
 		/* are we done? */
@@ -764,6 +756,8 @@ slow(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 	int c = (start == m->beginp) ? OUT : *(start-1);
 	int lastc;	/* previous c */
 	int flagch;
+	int boleol;		/* BOL/EOL flag here, and its steps */
+	int nboleol;
 	int i;
 	char *matchp;	/* last p at which a match ended */
 
@@ -791,6 +785,8 @@ slow(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 			flagch = (flagch == BOL) ? BOLEOL : EOL;
 			i += m->g->neol;
 		}
+		boleol = flagch;
+		nboleol = i;
 		if (i != 0) {
 			for (; i > 0; i--)
 				st = step(m->g, startst, stopst, st, flagch, st);
@@ -809,6 +805,9 @@ slow(struct match *m, char *start, char *stop, sopno startst, sopno stopst)
 		if (flagch == BOW || flagch == EOW) {
 			st = step(m->g, startst, stopst, st, flagch, st);
 			SP("sboweow", st, c);
+			/* and again, for a ^ or $ after the \< or \> */
+			for (i = nboleol; i > 0; i--)
+				st = step(m->g, startst, stopst, st, boleol, st);
 		}
 
 		/* are we done? */
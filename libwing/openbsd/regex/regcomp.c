@@ -65,6 +65,23 @@ struct parse {
 #	define	NPAREN	10	/* we need to remember () 1-9 for back refs */
 	sopno pbegin[NPAREN];	/* -> ( ([0] unused) */
 	sopno pend[NPAREN];	/* -> ) ([0] unused) */
+	struct urange *uranges;	/* non-ASCII part of a [], for REG_UTF8 */
+	size_t nuranges;	/* number in use */
+	size_t auranges;	/* number allocated */
+};
+
+/* a range of code points */
+struct urange {
+	int lo;
+	int hi;
+};
+
+/* for emitting an alternation one branch at a time, as p_ere() does */
+struct alts {
+	sopno start;		/* where the first branch began */
+	sopno prevfwd;
+	sopno prevback;
+	int n;			/* branches so far */
 };
 
 static void p_ere(struct parse *, int);
@@ -78,12 +95,24 @@ static void p_b_term(struct parse *, cset *);
 static void p_b_cclass(struct parse *, cset *);
 static void p_b_eclass(struct parse *, cset *);
 static char p_b_symbol(struct parse *);
+static void p_b_urange(struct parse *, cset *);
+static int p_b_usymbol(struct parse *);
+static int p_utf8(struct parse *);
 static char p_b_coll_elem(struct parse *, int);
 static char othercase(int);
 static void bothcases(struct parse *, int);
 static void ordinary(struct parse *, int);
 static void backslash(struct parse *, int);
 static void nonnewline(struct parse *);
+static void anyutf8(struct parse *);
+static void addurange(struct parse *, int, int);
+static void urangesnug(struct parse *, int);
+static void ubracket(struct parse *, cset *);
+static void altnext(struct parse *, struct alts *);
+static void altend(struct parse *, struct alts *);
+static void anymulti(struct parse *, struct alts *);
+static void utf8range(struct parse *, struct alts *, int, int);
+static void byterange(struct parse *, int, int);
 static void repeat(struct parse *, sopno, int, int);
 static int seterr(struct parse *, int);
 static cset *allocset(struct parse *);
@@ -94,20 +123,22 @@ static int nch(struct parse *, cset *);
 static void mcadd(struct parse *, cset *, char *);
 static void mcinvert(struct parse *, cset *);
 static void mccase(struct parse *, cset *);
-static int isinsets(struct re_guts *, int);
-static int samesets(struct re_guts *, int, int);
-static void categorize(struct parse *, struct re_guts *);
 static sopno dupl(struct parse *, sopno, sopno);
 static void doemit(struct parse *, sop, size_t);
 static void doinsert(struct parse *, sop, size_t, sopno);
 static void dofwd(struct parse *, sopno, sop);
 static int enlarge(struct parse *, sopno);
 static void stripsnug(struct parse *, struct re_guts *);
+static void setsnug(struct parse *, struct re_guts *);
 static void findmust(struct parse *, struct re_guts *);
 static sopno pluscount(struct parse *, struct re_guts *);
+static void plan(struct parse *, struct re_guts *);
 
 static char nuls[10];		/* place to point scanner in event of error */
 
+/* marker bits of a UTF-8 lead byte, by encoded length */
+static const uch utf8lead[] = { 0, 0x00, 0xc0, 0xe0, 0xf0 };
+
 /*
  * macros for use with parse structure
  * BEWARE:  these know that the parse structure is named `p' !!!
@@ -190,6 +221,9 @@ regcomp(regex_t *preg, const char *pattern, int cflags)
 	p->end = p->next + len;
 	p->error = 0;
 	p->ncsalloc = 0;
+	p->uranges = NULL;
+	p->nuranges = 0;
+	p->auranges = 0;
 	for (i = 0; i < NPAREN; i++) {
 		p->pbegin[i] = 0;
 		p->pend[i] = 0;
@@ -205,28 +239,52 @@ regcomp(regex_t *preg, const char *pattern, int cflags)
 	g->must = NULL;
 	g->mlen = 0;
 	g->nsub = 0;
-	g->ncategories = 1;	/* category 0 is "everything else" */
-	g->categories = &g->catspace[-(CHAR_MIN)];
-	memset(g->catspace, 0, sizeof(g->catspace));
+	g->ncategories = 0;	/* not worked out yet */
+	g->categories = NULL;
+	g->catspace = NULL;
 	g->backrefs = 0;
+	g->pclass = 0;
+	g->engine = 0;
+	g->prefilter = REG_PREFILTER_NONE;
+	g->prefix = NULL;
+	g->plen = 0;
 
 	/* do it */
 	EMIT(OEND, 0);
 	g->firststate = THERE();
+	if (cflags&REG_LINE) {
+		EMIT(OBOL, 0);
+		g->iflags |= USEBOL;
+		g->nbol++;
+	} else if (cflags&REG_WORD)
+		EMIT(OBOW, 0);
 	if (cflags&REG_EXTENDED)
 		p_ere(p, OUT);
 	else if (cflags&REG_NOSPEC)
 		p_str(p);
 	else
 		p_bre(p, OUT, OUT);
+	if (cflags&REG_LINE) {
+		EMIT(OEOL, 0);
+		g->iflags |= USEEOL;
+		g->neol++;
+	} else if (cflags&REG_WORD) {
+		EMIT(OEOW, 0);
+		/* put a leading ^ first, where the ANCHOR check looks for it */
+		if (p->error == 0 && OP(p->strip[2]) == OBOL) {
+			p->strip[1] = SOP(OBOL, 0);
+			p->strip[2] = SOP(OBOW, 0);
+		}
+	}
 	EMIT(OEND, 0);
 	g->laststate = THERE();
 
 	/* tidy up loose ends and fill things in */
-	categorize(p, g);
 	stripsnug(p, g);
+	setsnug(p, g);
 	findmust(p, g);
 	g->nplus = pluscount(p, g);
+	plan(p, g);
 	g->magic = MAGIC2;
 	preg->re_nsub = g->nsub;
 	preg->re_g = g;
@@ -238,6 +296,7 @@ regcomp(regex_t *preg, const char *pattern, int cflags)
 #endif
 
 	/* win or lose, we're done */
+	free(p->uranges);
 	if (p->error != 0)	/* lose */
 		regfree(preg);
 	return(p->error);
@@ -340,7 +399,9 @@ p_ere_exp(struct parse *p)
 		SETERROR(REG_BADRPT);
 		break;
 	case '.':
-		if (p->g->cflags&REG_NEWLINE)
+		if (p->g->cflags&REG_UTF8)
+			anyutf8(p);
+		else if (p->g->cflags&REG_NEWLINE)
 			nonnewline(p);
 		else
 			EMIT(OANY, 0);
@@ -437,10 +498,9 @@ p_str(struct parse *p)
  * Giving end1 as OUT essentially eliminates the end1/end2 check.
  *
  * This implementation is a bit of a kludge, in that a trailing $ is first
- * taken as an ordinary character and then revised to be an anchor.  The
- * only undesirable side effect is that '$' gets included as a character
- * category in such cases.  This is fairly harmless; not worth fixing.
- * The amount of lookahead needed to avoid this kludge is excessive.
+ * taken as an ordinary character and then revised to be an anchor.
+ * Categories are worked out from the finished strip, so this leaves no
+ * trace.  The amount of lookahead needed to avoid this kludge is excessive.
  */
 static void
 p_bre(struct parse *p,
@@ -495,7 +555,9 @@ p_simp_re(struct parse *p,
 	}
 	switch (c) {
 	case '.':
-		if (p->g->cflags&REG_NEWLINE)
+		if (p->g->cflags&REG_UTF8)
+			anyutf8(p);
+		else if (p->g->cflags&REG_NEWLINE)
 			nonnewline(p);
 		else
 			EMIT(OANY, 0);
@@ -638,6 +700,7 @@ p_bracket(struct parse *p)
 		/* allocset did set error status in p */
 		return;
 	}
+	p->nuranges = 0;
 
 	if (EAT('^'))
 		invert++;	/* make note to invert set at end */
@@ -672,7 +735,9 @@ p_bracket(struct parse *p)
 	if (invert) {
 		int i;
 
-		for (i = p->g->csetsize - 1; i >= 0; i--)
+		/* in UTF-8, bytes past ASCII are never characters alone */
+		i = (p->g->cflags&REG_UTF8) ? 0x7f : p->g->csetsize - 1;
+		for (; i >= 0; i--)
 			if (CHIN(cs, i))
 				CHsub(cs, i);
 			else
@@ -685,6 +750,14 @@ p_bracket(struct parse *p)
 
 	assert(cs->multis == NULL);		/* xxx */
 
+	if (p->g->cflags&REG_UTF8) {
+		urangesnug(p, invert);
+		if (p->nuranges > 0) {
+			ubracket(p, cs);
+			return;
+		}
+	}
+
 	if (nch(p, cs) == 1) {		/* optimize singleton sets */
 		ordinary(p, firstch(p, cs));
 		freeset(p, cs);
@@ -736,6 +809,10 @@ p_b_term(struct parse *p, cset *cs)
 		(void)REQUIRE(EATTWO('=', ']'), REG_ECOLLATE);
 		break;
 	default:		/* symbol, ordinary character, or range */
+		if (p->g->cflags&REG_UTF8) {
+			p_b_urange(p, cs);
+			break;
+		}
 /* xxx revision needed for multichar stuff */
 		start = p_b_symbol(p);
 		if (SEE('-') && MORE2() && PEEK2() != ']') {
@@ -818,6 +895,83 @@ p_b_symbol(struct parse *p)
 	return(value);
 }
 
+/*
+ - p_b_urange - REG_UTF8 version of a symbol, ordinary character, or range
+ *
+ * The ASCII part goes in cs as usual; the rest is kept as code points
+ * in p->uranges until ubracket() turns it into byte sequences.
+ */
+static void
+p_b_urange(struct parse *p, cset *cs)
+{
+	int start, finish;
+	int i;
+
+	start = p_b_usymbol(p);
+	if (SEE('-') && MORE2() && PEEK2() != ']') {
+		/* range */
+		NEXT();
+		if (EAT('-'))
+			finish = '-';
+		else
+			finish = p_b_usymbol(p);
+	} else
+		finish = start;
+	(void)REQUIRE(start <= finish, REG_ERANGE);
+	for (i = start; i <= finish && i < 0x80; i++)
+		CHadd(cs, i);
+	if (finish >= 0x80)
+		addurange(p, (start < 0x80) ? 0x80 : start, finish);
+}
+
+/*
+ - p_b_usymbol - parse a character or collating symbol as a code point
+ */
+static int			/* code point */
+p_b_usymbol(struct parse *p)
+{
+	if (MORE() && (uch)PEEK() >= 0x80)
+		return(p_utf8(p));
+	return((uch)p_b_symbol(p));
+}
+
+/*
+ - p_utf8 - parse one UTF-8 encoded character
+ */
+static int			/* code point */
+p_utf8(struct parse *p)
+{
+	int c = (uch)GETNEXT();
+	int n;				/* continuation bytes still to come */
+	int min;			/* smallest code point that needs them */
+
+	if (c < 0x80)
+		return(c);
+	else if (c >= 0xc2 && c <= 0xdf) {
+		n = 1;
+		c &= 0x1f;
+		min = 0x80;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		n = 2;
+		c &= 0x0f;
+		min = 0x800;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		n = 3;
+		c &= 0x07;
+		min = 0x10000;
+	} else {
+		SETERROR(REG_ECOLLATE);
+		return(0);
+	}
+	for (; n > 0 && MORE() && ((uch)PEEK() & 0xc0) == 0x80; n--)
+		c = (c << 6) | ((uch)GETNEXT() & 0x3f);
+	if (n != 0 || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) {
+		SETERROR(REG_ECOLLATE);
+		return(0);
+	}
+	return(c);
+}
+
 /*
  - p_b_coll_elem - parse a collating-element name and look it up
  */
@@ -892,15 +1046,18 @@ bothcases(struct parse *p, int ch)
 static void
 ordinary(struct parse *p, int ch)
 {
-	cat_t *cap = p->g->categories;
+	int n;
 
 	if ((p->g->cflags&REG_ICASE) && isalpha((uch)ch) && othercase(ch) != ch)
 		bothcases(p, ch);
-	else {
+	else
 		EMIT(OCHAR, (uch)ch);
-		if (cap[ch] == 0)
-			cap[ch] = p->g->ncategories++;
-	}
+
+	/* a UTF-8 character is one atom, so repetition covers all of it */
+	if ((p->g->cflags&REG_UTF8) && (uch)ch >= 0xc0)
+		for (n = 1 + ((uch)ch >= 0xe0) + ((uch)ch >= 0xf0);
+		    n > 0 && MORE() && ((uch)PEEK() & 0xc0) == 0x80; n--)
+			EMIT(OCHAR, (uch)GETNEXT());
 }
 
 /*
@@ -946,6 +1103,265 @@ nonnewline(struct parse *p)
 	p->end = oldend;
 }
 
+/*
+ - anyutf8 - emit REG_UTF8 version of OANY
+ *
+ * Any ASCII character, or anything shaped like a multibyte character.
+ */
+static void
+anyutf8(struct parse *p)
+{
+	struct alts a;
+	cset *cs;
+	int i;
+
+	a.start = HERE();
+	a.n = 0;
+	if ((cs = allocset(p)) == NULL)
+		return;
+	for (i = 0; i < 0x80; i++)
+		CHadd(cs, i);
+	if (p->g->cflags&REG_NEWLINE)
+		CHsub(cs, '\n');
+	altnext(p, &a);
+	EMIT(OANYOF, freezeset(p, cs));
+	anymulti(p, &a);
+	altend(p, &a);
+}
+
+/*
+ - addurange - note a range of non-ASCII code points in a []
+ */
+static void
+addurange(struct parse *p, int lo, int hi)
+{
+	void *ptr;
+
+	if (p->nuranges == p->auranges) {
+		ptr = reallocarray(p->uranges, p->auranges*2 + 8,
+		    sizeof(struct urange));
+		if (ptr == NULL) {
+			SETERROR(REG_ESPACE);
+			return;
+		}
+		p->uranges = ptr;
+		p->auranges = p->auranges*2 + 8;
+	}
+	p->uranges[p->nuranges].lo = lo;
+	p->uranges[p->nuranges].hi = hi;
+	p->nuranges++;
+}
+
+static int
+urangecmp(const void *a, const void *b)
+{
+	return(((const struct urange *)a)->lo - ((const struct urange *)b)->lo);
+}
+
+/*
+ - urangesnug - sort and merge the code point ranges, inverting if asked
+ */
+static void
+urangesnug(struct parse *p, int invert)
+{
+	struct urange *u = p->uranges;
+	size_t i, n = 0;
+	int lo;
+
+	if (p->error != 0)
+		return;
+	if (p->nuranges > 1)
+		qsort(u, p->nuranges, sizeof(struct urange), urangecmp);
+	for (i = 0; i < p->nuranges; i++)
+		if (n > 0 && u[i].lo <= u[n-1].hi + 1) {
+			if (u[i].hi > u[n-1].hi)
+				u[n-1].hi = u[i].hi;
+		} else
+			u[n++] = u[i];
+	p->nuranges = n;
+
+	if (!invert)
+		return;
+	lo = 0x80;
+	p->nuranges = 0;
+	for (i = 0; i < n; i++) {
+		/* u[i] is not overwritten before it has been read */
+		int hi = u[i].lo - 1;
+		int next = u[i].hi + 1;
+
+		if (lo <= hi)
+			addurange(p, lo, hi);
+		lo = next;
+	}
+	if (lo <= 0x10ffff)
+		addurange(p, lo, 0x10ffff);
+}
+
+/*
+ - ubracket - emit a REG_UTF8 [] that has non-ASCII members
+ *
+ * The ASCII members stay a set; the rest become byte sequences, each a
+ * branch of one alternation.
+ */
+static void
+ubracket(struct parse *p, cset *cs)
+{
+	struct alts a;
+	size_t i;
+
+	a.start = HERE();
+	a.n = 0;
+	/* finish with cs first; allocating more sets may move it */
+	if (nch(p, cs) == 0)
+		freeset(p, cs);
+	else if (nch(p, cs) == 1) {
+		altnext(p, &a);
+		EMIT(OCHAR, (uch)firstch(p, cs));
+		freeset(p, cs);
+	} else {
+		altnext(p, &a);
+		EMIT(OANYOF, freezeset(p, cs));
+	}
+
+	if (p->nuranges == 1 && p->uranges[0].lo == 0x80 &&
+	    p->uranges[0].hi == 0x10ffff)
+		anymulti(p, &a);
+	else
+		for (i = 0; i < p->nuranges; i++)
+			utf8range(p, &a, p->uranges[i].lo, p->uranges[i].hi);
+	altend(p, &a);
+}
+
+/*
+ - altnext - start another branch of an alternation begun at a->start
+ */
+static void
+altnext(struct parse *p, struct alts *a)
+{
+	if (a->n == 1) {
+		INSERT(OCH_, a->start);
+		a->prevfwd = a->start;
+		a->prevback = a->start;
+	}
+	if (a->n >= 1) {
+		ASTERN(OOR1, a->prevback);
+		a->prevback = THERE();
+		AHEAD(a->prevfwd);
+		a->prevfwd = HERE();
+		EMIT(OOR2, 0);
+	}
+	a->n++;
+}
+
+/*
+ - altend - finish an alternation started with altnext()
+ */
+static void
+altend(struct parse *p, struct alts *a)
+{
+	if (a->n > 1) {
+		AHEAD(a->prevfwd);
+		ASTERN(O_CH, a->prevback);
+	}
+}
+
+/*
+ - anymulti - emit a branch for any multibyte UTF-8 character
+ *
+ * A lead byte and the continuation bytes after it.  On valid UTF-8 the
+ * next byte after a character is never a continuation byte, so this is
+ * exact there, and it is a lot smaller than spelling out every length.
+ */
+static void
+anymulti(struct parse *p, struct alts *a)
+{
+	sopno pos;
+
+	altnext(p, a);
+	byterange(p, 0xc0, 0xf7);
+	pos = HERE();
+	byterange(p, 0x80, 0xbf);
+	INSERT(OPLUS_, pos);
+	ASTERN(O_PLUS, pos);
+}
+
+/*
+ - utf8range - emit branches for the UTF-8 encodings of lo..hi
+ *
+ * Split the range until the two ends encode to the same length and each
+ * byte position varies independently; then it is one byte range per
+ * position.  This is the usual construction (RE2, Go's regexp/syntax).
+ */
+static void
+utf8range(struct parse *p, struct alts *a, int lo, int hi)
+{
+	static const int maxcp[] = { 0x7f, 0x7ff, 0xffff };
+	uch blo[4], bhi[4];
+	int i, m, n;
+
+	if (lo > hi)
+		return;
+	if (lo <= 0xdfff && hi >= 0xd800) {	/* no surrogates in UTF-8 */
+		utf8range(p, a, lo, 0xd7ff);
+		utf8range(p, a, 0xe000, hi);
+		return;
+	}
+	for (i = 0; i < 3; i++)
+		if (lo <= maxcp[i] && hi > maxcp[i]) {
+			utf8range(p, a, lo, maxcp[i]);
+			utf8range(p, a, maxcp[i] + 1, hi);
+			return;
+		}
+	for (i = 1; i < 4; i++) {
+		m = (1 << (6*i)) - 1;
+		if ((lo & ~m) == (hi & ~m))
+			continue;
+		if ((lo & m) != 0) {
+			utf8range(p, a, lo, lo | m);
+			utf8range(p, a, (lo | m) + 1, hi);
+			return;
+		}
+		if ((hi & m) != m) {
+			utf8range(p, a, lo, (hi & ~m) - 1);
+			utf8range(p, a, hi & ~m, hi);
+			return;
+		}
+	}
+
+	n = (hi <= 0x7f) ? 1 : (hi <= 0x7ff) ? 2 : (hi <= 0xffff) ? 3 : 4;
+	for (i = n-1; i > 0; i--) {
+		blo[i] = 0x80 | (lo & 0x3f);
+		bhi[i] = 0x80 | (hi & 0x3f);
+		lo >>= 6;
+		hi >>= 6;
+	}
+	blo[0] = utf8lead[n] | lo;
+	bhi[0] = utf8lead[n] | hi;
+	altnext(p, a);
+	for (i = 0; i < n; i++)
+		byterange(p, blo[i], bhi[i]);
+}
+
+/*
+ - byterange - emit a match for one byte in lo..hi
+ */
+static void
+byterange(struct parse *p, int lo, int hi)
+{
+	cset *cs;
+	int i;
+
+	if (lo == hi) {
+		EMIT(OCHAR, (uch)lo);
+		return;
+	}
+	if ((cs = allocset(p)) == NULL)
+		return;
+	for (i = lo; i <= hi; i++)
+		CHadd(cs, i);
+	EMIT(OANYOF, freezeset(p, cs));
+}
+
 /*
  - repeat - generate code for a bounded repetition, recursively if needed
  */
@@ -1227,63 +1643,83 @@ mccase(struct parse *p, cset *cs)
 }
 
 /*
- - isinsets - is this character in any sets?
- */
-static int			/* predicate */
-isinsets(struct re_guts *g, int c)
-{
-	uch *col;
-	int i;
-	int ncols = (g->ncsets+(CHAR_BIT-1)) / CHAR_BIT;
-	unsigned uc = (uch)c;
-
-	for (i = 0, col = g->setbits; i < ncols; i++, col += g->csetsize)
-		if (col[uc] != 0)
-			return(1);
-	return(0);
-}
-
-/*
- - samesets - are these two characters in exactly the same sets?
- */
-static int			/* predicate */
-samesets(struct re_guts *g, int c1, int c2)
-{
-	uch *col;
-	int i;
-	int ncols = (g->ncsets+(CHAR_BIT-1)) / CHAR_BIT;
-	unsigned uc1 = (uch)c1;
-	unsigned uc2 = (uch)c2;
-
-	for (i = 0, col = g->setbits; i < ncols; i++, col += g->csetsize)
-		if (col[uc1] != col[uc2])
-			return(0);
-	return(1);
-}
-
-/*
- - categorize - sort out character categories
+ - re_categorize - sort out character categories
+ *
+ * Nothing in the matchers needs these, so they are worked out from the
+ * finished strip on first request rather than carried around by every
+ * compiled pattern.  Every character that appears on its own gets a
+ * category of its own, in order of appearance; the rest are grouped by
+ * which sets they belong to.  The set bitmaps are transposed so that
+ * each character's memberships form one signature, and characters with
+ * equal signatures are found by hashing, so the cost is linear in the
+ * number of sets.  Not thread-safe on first use.
  */
-static void
-categorize(struct parse *p, struct re_guts *g)
+int				/* 0 success, REG_ESPACE failure */
+re_categorize(struct re_guts *g)
 {
-	cat_t *cats = g->categories;
+	size_t ncols = (g->ncsets + (CHAR_BIT-1)) / CHAR_BIT;
+	uch *sigs = NULL;	/* -> uch [NC][ncols], signatures */
+	uch *sig;
+	int slot[2*NC];		/* hash of signatures, holding a char */
+	unsigned long h;
+	int nonempty;
+	cat_t *cats;
 	int c;
-	int c2;
-	cat_t cat;
+	size_t col;
+	size_t j;
+	sopno i;
 
-	/* avoid making error situations worse */
-	if (p->error != 0)
-		return;
+	if (g->categories != NULL)
+		return(0);
+	g->catspace = calloc(NC, sizeof(cat_t));
+	if (ncols > 0)
+		sigs = reallocarray(NULL, NC, ncols);
+	if (g->catspace == NULL || (ncols > 0 && sigs == NULL)) {
+		free(g->catspace);
+		g->catspace = NULL;
+		free(sigs);
+		return(REG_ESPACE);
+	}
+	cats = &g->catspace[-(CHAR_MIN)];
+	g->ncategories = 1;	/* category 0 is "everything else" */
+
+	for (i = 0; i < g->nstates; i++)
+		if (OP(g->strip[i]) == OCHAR) {
+			c = (char)OPND(g->strip[i]);
+			if (cats[c] == 0)
+				cats[c] = g->ncategories++;
+		}
 
-	for (c = CHAR_MIN; c <= CHAR_MAX; c++)
-		if (cats[c] == 0 && isinsets(g, c)) {
-			cat = g->ncategories++;
-			cats[c] = cat;
-			for (c2 = c+1; c2 <= CHAR_MAX; c2++)
-				if (cats[c2] == 0 && samesets(g, c, c2))
-					cats[c2] = cat;
+	for (col = 0; col < ncols; col++)
+		for (j = 0; j < NC; j++)
+			sigs[j*ncols + col] = g->setbits[col*g->csetsize + j];
+	for (j = 0; j < 2*NC; j++)
+		slot[j] = OUT;
+	for (c = CHAR_MIN; c <= CHAR_MAX && ncols > 0; c++) {
+		if (cats[c] != 0)
+			continue;
+		sig = &sigs[(uch)c * ncols];
+		h = 2166136261UL;
+		nonempty = 0;
+		for (col = 0; col < ncols; col++) {
+			nonempty |= sig[col];
+			h = (h ^ sig[col]) * 16777619UL;
 		}
+		if (!nonempty)		/* in no sets at all */
+			continue;
+		for (h %= 2*NC; slot[h] != OUT; h = (h + 1) % (2*NC))
+			if (memcmp(&sigs[(uch)slot[h] * ncols], sig, ncols) == 0)
+				break;
+		if (slot[h] == OUT) {
+			slot[h] = c;
+			cats[c] = g->ncategories++;
+		} else
+			cats[c] = cats[slot[h]];
+	}
+
+	free(sigs);
+	g->categories = cats;
+	return(0);
 }
 
 /*
@@ -1418,6 +1854,55 @@ stripsnug(struct parse *p, struct re_guts *g)
 	}
 }
 
+/*
+ - setsnug - compact the character sets, sharing them if asked to
+ *
+ * allocset() grows the set storage a column of CHAR_BIT sets at a time,
+ * and freeset() leaves holes behind, so trim to what is actually in use.
+ * With REG_SHARE, identical bitmaps from different patterns are kept
+ * only once; that pays off handsomely for big generated pattern sets.
+ */
+static void
+setsnug(struct parse *p, struct re_guts *g)
+{
+	size_t css = (size_t)g->csetsize;
+	size_t ncols = (g->ncsets + (CHAR_BIT-1)) / CHAR_BIT;
+	void *ptr;
+	uch *shared;
+	int i;
+
+	/* avoid making error situations worse */
+	if (p->error != 0 || g->sets == NULL)
+		return;
+
+	if (g->ncsets == 0) {
+		free(g->sets);
+		g->sets = NULL;
+		free(g->setbits);
+		g->setbits = NULL;
+		return;
+	}
+
+	ptr = reallocarray(g->sets, g->ncsets, sizeof(cset));
+	if (ptr != NULL)	/* else keep the roomier one */
+		g->sets = ptr;
+	ptr = reallocarray(g->setbits, ncols, css);
+	if (ptr != NULL)
+		g->setbits = ptr;
+
+	if (g->cflags&REG_SHARE) {
+		shared = re_setpool_intern(g->setbits, ncols * css);
+		if (shared != NULL) {
+			free(g->setbits);
+			g->setbits = shared;
+			g->iflags |= SHARED;
+		}
+	}
+
+	for (i = 0; i < g->ncsets; i++)
+		g->sets[i].ptr = g->setbits + css*(i/CHAR_BIT);
+}
+
 /*
  - findmust - fill in must and mlen with longest mandatory literal string
  *
@@ -1534,3 +2019,116 @@ pluscount(struct parse *p, struct re_guts *g)
 		g->iflags |= BAD;
 	return(maxnest);
 }
+
+/*
+ - plan - classify the pattern and decide how regexec() should run it
+ *
+ * This runs last, so the strip is final and findmust() has had its say.
+ * The classes are ordered roughly by how cheap they are to execute;
+ * anything that needs back references is stuck with the backtracker no
+ * matter what else it looks like.
+ */
+static void
+plan(struct parse *p, struct re_guts *g)
+{
+	sop *scan;
+	sop s;
+	int bol = 0;
+	int eol = 0;
+	int bow = 0;
+	int eow = 0;
+	sopno nchar = 0;
+	char *cp;
+
+	/* avoid making error situations worse */
+	if (p->error != 0)
+		return;
+
+	if (g->nstates <= (sopno)(CHAR_BIT*sizeof(long)))
+		g->engine = REG_ENGINE_SMALL;
+	else
+		g->engine = REG_ENGINE_LARGE;
+
+	/* with REG_NEWLINE, a match can't cross lines unless \n is in it */
+	if (g->cflags&REG_NEWLINE) {
+		g->iflags |= ONELINE;
+		for (scan = g->strip + 1; OP(*scan) != OEND; scan++) {
+			s = *scan;
+			if ((OP(s) == OCHAR && (char)OPND(s) == '\n') ||
+			    OP(s) == OANY ||
+			    (OP(s) == OANYOF && CHIN(&g->sets[OPND(s)], '\n'))) {
+				g->iflags &= ~ONELINE;
+				break;
+			}
+		}
+	}
+
+	/* ^ at the very front pins the match unless ^ can follow \n too */
+	if (OP(g->strip[1]) == OBOL && !(g->cflags&REG_NEWLINE))
+		g->iflags |= ANCHOR;
+
+	/* is the whole thing a literal, maybe with ^ \< at the front and
+	   \> $ at the back? */
+	scan = g->strip + 1;
+	for (; OP(*scan) == OBOL || OP(*scan) == OBOW; scan++)
+		if (OP(*scan) == OBOL)
+			bol = 1;
+		else
+			bow = 1;
+	while (OP(*scan) == OCHAR) {
+		nchar++;
+		scan++;
+	}
+	for (; OP(*scan) == OEOL || OP(*scan) == OEOW; scan++)
+		if (OP(*scan) == OEOL)
+			eol = 1;
+		else
+			eow = 1;
+	if (OP(*scan) == OEND && (nchar == 0 || nchar == g->mlen) &&
+	    (nchar > 0 || (!bow && !eow))) {
+		if (!bol && !eol && !bow && !eow) {
+			g->pclass = REG_CLASS_LITERAL;
+			g->engine = REG_ENGINE_LITERAL;
+			g->prefilter = REG_PREFILTER_MUST;
+			return;
+		}
+		g->pclass = REG_CLASS_ANCHORED;
+		g->engine = REG_ENGINE_ANCHORED;
+		return;
+	}
+
+	/* collect the literal prefix; parens don't consume anything */
+	for (scan = g->strip + 1; ; scan++) {
+		s = *scan;
+		if (OP(s) == OCHAR)
+			g->plen++;
+		else if (OP(s) != OLPAREN && OP(s) != ORPAREN)
+			break;
+	}
+	if (g->plen > 0) {
+		g->prefix = malloc((size_t)g->plen + 1);
+		if (g->prefix == NULL)		/* just do without */
+			g->plen = 0;
+	}
+	if (g->plen > 0) {
+		cp = g->prefix;
+		for (scan = g->strip + 1; cp < g->prefix + g->plen; scan++)
+			if (OP(*scan) == OCHAR)
+				*cp++ = (char)OPND(*scan);
+		*cp = '\0';
+	}
+
+	if (g->backrefs)
+		g->pclass = REG_CLASS_BACKREF;
+	else if (g->plen > 0)
+		g->pclass = REG_CLASS_PREFIXED;
+	else if (g->engine == REG_ENGINE_SMALL)
+		g->pclass = REG_CLASS_SMALL;
+	else
+		g->pclass = REG_CLASS_LARGE;
+
+	if (g->plen > 0)
+		g->prefilter = REG_PREFILTER_PREFIX;
+	else if (g->must != NULL)
+		g->prefilter = REG_PREFILTER_MUST;
+}
@@ -38,6 +38,8 @@
 /*
  * internals of regex_t
  */
+#include <stdint.h>
+
 #define	MAGIC1	((('r'^0200)<<8) | 'e')
 
 /*
@@ -59,7 +61,7 @@
  * In state representations, an operator's bit is on to signify a state
  * immediately *preceding* "execution" of that operator.
  */
-typedef unsigned long sop;	/* strip operator */
+typedef uint32_t sop;		/* strip operator */
 typedef long sopno;
 #define	OPRMASK	0xf8000000LU
 #define	OPDMASK	0x07ffffffLU
@@ -139,19 +141,33 @@ struct re_guts {
 #		define	USEBOL	01	/* used ^ */
 #		define	USEEOL	02	/* used $ */
 #		define	BAD	04	/* something wrong */
+#		define	ANCHOR	010	/* can only match at start of string */
+#		define	SHARED	020	/* setbits belongs to the set pool */
+#		define	MAPPED	040	/* strip etc. are in a regcache file */
+#		define	ONELINE	0100	/* REG_NEWLINE, and nothing matches \n */
 	int nbol;		/* number of ^ used */
 	int neol;		/* number of $ used */
 	int ncategories;	/* how many character categories */
-	cat_t *categories;	/* ->catspace[-CHAR_MIN] */
+	cat_t *categories;	/* ->catspace[-CHAR_MIN], see re_categorize() */
+	cat_t *catspace;	/* malloced on first use, or NULL */
 	char *must;		/* match must contain this string */
 	int mlen;		/* length of must */
 	size_t nsub;		/* copy of re_nsub */
 	int backrefs;		/* does it use back references? */
 	sopno nplus;		/* how deep does it nest +s? */
-	/* catspace must be last */
-	cat_t catspace[NC];	/* actually [NC] */
+	int pclass;		/* what kind of pattern, REG_CLASS_* */
+	int engine;		/* how to run it, REG_ENGINE_* */
+	int prefilter;		/* how to prescreen, REG_PREFILTER_* */
+	char *prefix;		/* every match starts with this string */
+	int plen;		/* length of prefix */
 };
 
+/* shared between the regex source files */
+int re_categorize(struct re_guts *);
+uch *re_setpool_intern(uch *, size_t);
+void re_setpool_release(uch *, size_t);
+unsigned long re_setpool_refs(uch *, size_t);
+
 /* misc utilities */
 #define	OUT	(CHAR_MAX+1)	/* a non-character value */
 #define	ISWORD(c)	(isalnum(c) || (c) == '_')
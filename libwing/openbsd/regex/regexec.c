@@ -128,12 +128,261 @@
 
 #include "engine.c"
 
+/*
+ - findlit - find the first occurrence of a literal, the prescreen workhorse
+ */
+static char *			/* where it starts, or NULL */
+findlit(char *start, char *stop, const char *lit, size_t len)
+{
+	char *dp;
+
+	if (len == 0)
+		return(start);
+	while ((size_t)(stop - start) >= len) {
+		dp = memchr(start, lit[0], (size_t)(stop - start) - len + 1);
+		if (dp == NULL)
+			break;
+		if (memcmp(dp + 1, lit + 1, len - 1) == 0)
+			return(dp);
+		start = dp + 1;
+	}
+	return(NULL);
+}
+
+/*
+ - litmatch - matcher for REG_ENGINE_LITERAL, where the must is everything
+ */
+static int			/* 0 success, REG_NOMATCH failure */
+litmatch(struct re_guts *g, char *string, char *start, char *stop,
+    size_t nmatch, regmatch_t pmatch[])
+{
+	char *dp;
+	size_t i;
+
+	dp = findlit(start, stop, g->must, (size_t)g->mlen);
+	if (dp == NULL)
+		return(REG_NOMATCH);
+	if (nmatch > 0) {
+		pmatch[0].rm_so = dp - string;
+		pmatch[0].rm_eo = dp + g->mlen - string;
+	}
+	for (i = 1; i < nmatch; i++)
+		pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+	return(0);
+}
+
+/*
+ - edges - does the literal at dp satisfy the anchors around it?
+ *
+ * This has to agree with what the automaton makes of ^, $, \< and \>,
+ * which goes by the characters either side and the ends of the string.
+ */
+static int
+edges(struct re_guts *g, char *begin, char *stop, char *dp, int eflags,
+    int bol, int eol, int bow, int eow)
+{
+	char *end = dp + g->mlen;
+	int atbol, ateol;
+
+	if (dp == begin)
+		atbol = !(eflags&REG_NOTBOL);
+	else
+		atbol = (g->cflags&REG_NEWLINE) && dp[-1] == '\n';
+	if (end == stop)
+		ateol = !(eflags&REG_NOTEOL);
+	else
+		ateol = (g->cflags&REG_NEWLINE) && *end == '\n';
+	if ((bol && !atbol) || (eol && !ateol))
+		return(0);
+	if (bow && !(ISWORD((uch)dp[0]) &&
+	    ((dp == begin) ? atbol : !ISWORD((uch)dp[-1]))))
+		return(0);
+	if (eow && !(ISWORD((uch)end[-1]) &&
+	    ((end == stop) ? ateol : !ISWORD((uch)*end))))
+		return(0);
+	return(1);
+}
+
+/*
+ - anchmatch - matcher for REG_ENGINE_ANCHORED, a literal with anchors
+ *
+ * ^literal, literal$ and ^literal$ only need comparing at the ends of the
+ * string.  With REG_NEWLINE, or \< or \>, each copy of the literal is
+ * found in turn and the anchors checked around it.
+ */
+static int			/* 0 success, REG_NOMATCH failure */
+anchmatch(struct re_guts *g, char *string, char *begin, char *start,
+    char *stop, size_t nmatch, regmatch_t pmatch[], int eflags)
+{
+	size_t len = (size_t)g->mlen;
+	int bol = 0, eol = 0, bow = 0, eow = 0;
+	sopno n;
+	char *dp;
+	size_t i;
+
+	for (n = 1; OP(g->strip[n]) == OBOL || OP(g->strip[n]) == OBOW; n++)
+		if (OP(g->strip[n]) == OBOL)
+			bol = 1;
+		else
+			bow = 1;
+	for (n = g->laststate - 1;
+	    OP(g->strip[n]) == OEOL || OP(g->strip[n]) == OEOW; n--)
+		if (OP(g->strip[n]) == OEOL)
+			eol = 1;
+		else
+			eow = 1;
+
+	if (!bow && !eow && !(g->cflags&REG_NEWLINE)) {
+		if ((bol && (eflags&REG_NOTBOL)) ||
+		    (eol && (eflags&REG_NOTEOL)))
+			return(REG_NOMATCH);
+		if (bol && start != begin)
+			return(REG_NOMATCH);
+		if ((size_t)(stop - start) < len)
+			return(REG_NOMATCH);
+		if (bol && eol && (size_t)(stop - start) != len)
+			return(REG_NOMATCH);
+		dp = bol ? start : stop - len;
+		if (len > 0 && memcmp(dp, g->must, len) != 0)
+			return(REG_NOMATCH);
+	} else {
+		for (dp = start; ; dp++) {
+			dp = findlit(dp, stop, g->must, len);
+			if (dp == NULL)
+				return(REG_NOMATCH);
+			if (edges(g, begin, stop, dp, eflags, bol, eol, bow,
+			    eow))
+				break;
+			if (dp == stop)
+				return(REG_NOMATCH);
+		}
+	}
+
+	if (nmatch > 0) {
+		pmatch[0].rm_so = dp - string;
+		pmatch[0].rm_eo = dp + len - string;
+	}
+	for (i = 1; i < nmatch; i++)
+		pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+	return(0);
+}
+
+/*
+ * Where the prescreen last found its literals in a string.  Searching
+ * the same string again from further on, as regiter_next() does, need
+ * not look again until the search has moved past them.
+ */
+struct seen {
+	char *prefix;
+	char *must;
+};
+
+/*
+ - automaton - run whichever state-set matcher suits the pattern
+ */
+static int
+automaton(struct re_guts *g, char *string, char *begin, char *start,
+    char *stop, size_t nmatch, regmatch_t pmatch[], int eflags)
+{
+	if (g->engine == REG_ENGINE_SMALL && !(eflags&REG_LARGE))
+		return(smatcher(g, string, begin, start, stop, nmatch, pmatch,
+		    eflags));
+	else
+		return(lmatcher(g, string, begin, start, stop, nmatch, pmatch,
+		    eflags));
+}
+
+/*
+ - linematch - run the automaton over just the lines holding the must
+ *
+ * For ONELINE patterns, whose matches never cross a newline.  On a big
+ * buffer with the must here and there, that's much less than running it
+ * from the first copy of the must to the end.  A line's newline stops
+ * the automaton as the end of the string would, which with REG_NEWLINE
+ * is the same as far as $ and \> are concerned.
+ */
+static int
+linematch(struct re_guts *g, char *string, char *begin, char *start,
+    char *stop, size_t nmatch, regmatch_t pmatch[], int eflags,
+    struct seen *seen)
+{
+	char *lo, *hi;
+	int ret;
+
+	for (;;) {
+		if (seen->must == NULL || seen->must < start)
+			seen->must = findlit(start, stop, g->must,
+			    (size_t)g->mlen);
+		if (seen->must == NULL)
+			return(REG_NOMATCH);
+		lo = seen->must;
+		while (lo > start && lo[-1] != '\n')
+			lo--;
+		hi = memchr(seen->must + g->mlen, '\n',
+		    (size_t)(stop - (seen->must + g->mlen)));
+		if (hi == NULL)
+			return(automaton(g, string, begin, lo, stop, nmatch,
+			    pmatch, eflags));
+		ret = automaton(g, string, begin, lo, hi, nmatch, pmatch,
+		    eflags&~REG_NOTEOL);
+		if (ret != REG_NOMATCH)
+			return(ret);
+		start = hi + 1;
+	}
+}
+
+/*
+ - execute - prescreen, then run the engine the planner chose
+ *
+ * begin is where the string really starts, for ^ and \<; the search
+ * covers start to stop.
+ */
+static int			/* 0 success, REG_NOMATCH failure */
+execute(struct re_guts *g, char *string, char *begin, char *start,
+    char *stop, size_t nmatch, regmatch_t pmatch[], int eflags,
+    struct seen *seen)
+{
+	switch (g->engine) {
+	case REG_ENGINE_LITERAL:
+		return(litmatch(g, string, start, stop, nmatch, pmatch));
+	case REG_ENGINE_ANCHORED:
+		return(anchmatch(g, string, begin, start, stop, nmatch, pmatch,
+		    eflags));
+	}
+
+	/* prescreening; this does wonders for this rather slow code */
+	if (g->prefilter == REG_PREFILTER_PREFIX) {
+		/* no match can start before the first copy of the prefix */
+		if (seen->prefix == NULL || seen->prefix < start)
+			seen->prefix = findlit(start, stop, g->prefix,
+			    (size_t)g->plen);
+		if (seen->prefix == NULL)
+			return(REG_NOMATCH);
+		start = seen->prefix;
+	}
+	if (g->must != NULL && (g->iflags&ONELINE))
+		return(linematch(g, string, begin, start, stop, nmatch, pmatch,
+		    eflags, seen));
+	if (g->must != NULL && g->mlen > g->plen) {
+		/* nor can it start after the last copy of the must */
+		if (seen->must == NULL || seen->must < start)
+			seen->must = findlit(start, stop, g->must,
+			    (size_t)g->mlen);
+		if (seen->must == NULL)
+			return(REG_NOMATCH);
+	}
+
+	return(automaton(g, string, begin, start, stop, nmatch, pmatch,
+	    eflags));
+}
+
 /*
  - regexec - interface for matching
  *
  * We put this here so we can exploit knowledge of the state representation
  * when choosing which matcher to call.  Also, by this point the matchers
- * have been prototyped.
+ * have been prototyped.  The choice itself was made by regcomp()'s
+ * planner; all we do here is follow it.
  */
 int				/* 0 success, REG_NOMATCH failure */
 regexec(const regex_t *preg, const char *string, size_t nmatch,
@@ -141,6 +390,9 @@ regexec(const regex_t *preg, const char *string, size_t nmatch,
 {
 	struct re_guts *g = preg->re_g;
 	char *s = (char *)string; /* XXX fucking gcc XXX */
+	char *start;
+	char *stop;
+	struct seen seen;
 
 #ifdef REDEBUG
 #	define	GOODFLAGS(f)	(f)
@@ -155,8 +407,118 @@ regexec(const regex_t *preg, const char *string, size_t nmatch,
 		return(REG_BADPAT);
 	eflags = GOODFLAGS(eflags);
 
-	if (g->nstates <= (sopno)(CHAR_BIT*sizeof(states1)) && !(eflags&REG_LARGE))
-		return(smatcher(g, s, nmatch, pmatch, eflags));
-	else
-		return(lmatcher(g, s, nmatch, pmatch, eflags));
+	if (eflags&REG_STARTEND) {
+		start = s + pmatch[0].rm_so;
+		stop = s + pmatch[0].rm_eo;
+	} else {
+		start = s;
+		stop = start + strlen(start);
+	}
+	if (stop < start)
+		return(REG_INVARG);
+	if (g->cflags&REG_NOSUB)
+		nmatch = 0;
+
+	seen.prefix = NULL;
+	seen.must = NULL;
+	return(execute(g, s, start, start, stop, nmatch, pmatch, eflags,
+	    &seen));
+}
+
+/*
+ - regiter_init - set up to find every match in a buffer
+ */
+void
+regiter_init(regiter_t *it, const regex_t *preg, const char *buf, size_t len,
+    int eflags)
+{
+	it->preg = preg;
+	it->buf = buf;
+	it->len = len;
+	it->eflags = eflags&(REG_NOTBOL|REG_NOTEOL);
+	it->pos = 0;
+	it->prev_end = (size_t)-1;
+	it->prefix_at = NULL;
+	it->must_at = NULL;
+}
+
+/*
+ - regiter_seek - carry on searching from somewhere else
+ */
+void
+regiter_seek(regiter_t *it, size_t pos)
+{
+	it->pos = (pos > it->len) ? it->len + 1 : pos;
+	it->prev_end = (size_t)-1;
+}
+
+/*
+ - regiter_next - find the next match
+ *
+ * Each search resumes where the last match ended, with the engine seeing
+ * the whole buffer, so ^ and \< behave as if it were searched at once.
+ * After an empty match the search moves on a character, and an empty
+ * match right where the previous match ended is skipped, so the walk
+ * always makes progress and never reports the same text twice.
+ */
+int				/* 0 success, REG_NOMATCH when done */
+regiter_next(regiter_t *it, size_t nmatch, regmatch_t pmatch[])
+{
+	struct re_guts *g = it->preg->re_g;
+	char *s = (char *)it->buf;
+	regmatch_t whole;
+	struct seen seen;
+	size_t so, eo;
+	size_t i;
+	int ret;
+
+	if (it->preg->re_magic != MAGIC1 || g->magic != MAGIC2)
+		return(REG_BADPAT);
+	if (g->iflags&BAD)
+		return(REG_BADPAT);
+
+	/* we need to know where matches end even if the caller doesn't */
+	if (nmatch == 0) {
+		nmatch = 1;
+		pmatch = &whole;
+	}
+	if (g->cflags&REG_NOSUB) {
+		for (i = 1; i < nmatch; i++)
+			pmatch[i].rm_so = pmatch[i].rm_eo = -1;
+		nmatch = 1;
+	}
+
+	seen.prefix = (char *)it->prefix_at;
+	seen.must = (char *)it->must_at;
+	for (;;) {
+		if (it->pos > it->len)
+			return(REG_NOMATCH);
+		ret = execute(g, s, s, s + it->pos, s + it->len, nmatch,
+		    pmatch, it->eflags, &seen);
+		it->prefix_at = seen.prefix;
+		it->must_at = seen.must;
+		if (ret != 0) {
+			if (ret == REG_NOMATCH)
+				it->pos = it->len + 1;
+			return(ret);
+		}
+
+		so = (size_t)pmatch[0].rm_so;
+		eo = (size_t)pmatch[0].rm_eo;
+		if (eo == it->pos) {
+			/* empty, so step over a character */
+			it->pos++;
+			if (g->cflags&REG_UTF8)
+				while (it->pos < it->len &&
+				    ((uch)s[it->pos] & 0xc0) == 0x80)
+					it->pos++;
+		} else
+			it->pos = eo;
+		if (so == eo && so == it->prev_end) {
+			it->prev_end = eo;
+			continue;	/* abuts the last match */
+		}
+		it->prev_end = eo;
+		return(0);
+	}
 }
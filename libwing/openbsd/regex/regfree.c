@@ -60,13 +60,25 @@ regfree(regex_t *preg)
 	preg->re_magic = 0;		/* mark it invalid */
 	g->magic = 0;			/* mark it invalid */
 
-	if (g->strip != NULL)
-		free((char *)g->strip);
 	if (g->sets != NULL)
 		free((char *)g->sets);
-	if (g->setbits != NULL)
+	if (g->catspace != NULL)
+		free(g->catspace);
+	if (g->iflags&MAPPED) {		/* the rest belongs to the regcache */
+		free((char *)g);
+		return;
+	}
+
+	if (g->strip != NULL)
+		free((char *)g->strip);
+	if (g->setbits != NULL && (g->iflags&SHARED))
+		re_setpool_release(g->setbits, (size_t)g->csetsize *
+		    ((g->ncsets + (CHAR_BIT-1)) / CHAR_BIT));
+	else if (g->setbits != NULL)
 		free((char *)g->setbits);
 	if (g->must != NULL)
 		free(g->must);
+	if (g->prefix != NULL)
+		free(g->prefix);
 	free((char *)g);
 }
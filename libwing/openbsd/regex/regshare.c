@@ -0,0 +1,146 @@
+/*
+ * Process-wide pool of character-set bitmaps, for REG_SHARE.
+ *
+ * Programs that compile tens of thousands of generated patterns tend to
+ * use the same handful of bracket expressions over and over ([0-9],
+ * [A-Za-z_], ...), so identical setbits arrays are kept once and
+ * reference counted.  The pool is not locked: callers that compile or
+ * free REG_SHARE patterns from several threads must serialize those
+ * calls themselves.  regexec() never touches the pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include <libwing/regex.h>
+
+#include "utils.h"
+#include "regex2.h"
+
+struct poolent {
+	struct poolent *next;	/* hash chain */
+	size_t len;		/* bytes in bits */
+	unsigned long hash;
+	unsigned long refs;
+	uch bits[];
+};
+
+static struct poolent **pool;	/* hash buckets */
+static size_t npool;		/* number of buckets */
+static size_t nents;		/* number of entries */
+
+#define	ENTRY(b)	((struct poolent *)((char *)(b) - offsetof(struct poolent, bits)))
+
+/*
+ - poolhash - FNV-1a over a bitmap
+ */
+static unsigned long
+poolhash(const uch *bits, size_t len)
+{
+	unsigned long h = 2166136261UL;
+
+	while (len-- > 0) {
+		h ^= *bits++;
+		h *= 16777619UL;
+	}
+	return(h);
+}
+
+/*
+ - poolgrow - double the bucket count, rehashing what's there
+ */
+static int			/* 0 failure, 1 success */
+poolgrow(void)
+{
+	size_t n = (npool == 0) ? 64 : npool * 2;
+	struct poolent **np;
+	struct poolent *e;
+	struct poolent *next;
+	size_t i;
+
+	np = calloc(n, sizeof(*np));
+	if (np == NULL)
+		return(0);
+	for (i = 0; i < npool; i++)
+		for (e = pool[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = np[e->hash % n];
+			np[e->hash % n] = e;
+		}
+	free(pool);
+	pool = np;
+	npool = n;
+	return(1);
+}
+
+/*
+ - re_setpool_intern - find or add a shared copy of a bitmap
+ *
+ * The caller keeps ownership of bits either way.
+ */
+uch *				/* shared copy, or NULL if out of memory */
+re_setpool_intern(uch *bits, size_t len)
+{
+	unsigned long h = poolhash(bits, len);
+	struct poolent *e;
+
+	if (npool != 0)
+		for (e = pool[h % npool]; e != NULL; e = e->next)
+			if (e->hash == h && e->len == len &&
+			    memcmp(e->bits, bits, len) == 0) {
+				e->refs++;
+				return(e->bits);
+			}
+
+	if (nents >= npool && !poolgrow() && npool == 0)
+		return(NULL);
+	e = malloc(sizeof(*e) + len);
+	if (e == NULL)
+		return(NULL);
+	e->len = len;
+	e->hash = h;
+	e->refs = 1;
+	memcpy(e->bits, bits, len);
+	e->next = pool[h % npool];
+	pool[h % npool] = e;
+	nents++;
+	return(e->bits);
+}
+
+/*
+ - re_setpool_release - drop a reference from re_setpool_intern()
+ */
+void
+re_setpool_release(uch *bits, size_t len)
+{
+	struct poolent *e = ENTRY(bits);
+	struct poolent **pp;
+
+	assert(e->len == len);
+	(void)len;
+	if (--e->refs > 0)
+		return;
+	for (pp = &pool[e->hash % npool]; *pp != e; pp = &(*pp)->next)
+		continue;
+	*pp = e->next;
+	nents--;
+	free(e);
+	if (nents == 0) {
+		free(pool);
+		pool = NULL;
+		npool = 0;
+	}
+}
+
+/*
+ - re_setpool_refs - how many patterns share this bitmap?
+ */
+unsigned long
+re_setpool_refs(uch *bits, size_t len)
+{
+	(void)len;
+	return(ENTRY(bits)->refs);
+}
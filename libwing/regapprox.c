@@ -0,0 +1,250 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+
+/*Approximate literal search.
+
+  The matcher is Myers' bit-vector algorithm: one machine word holds a
+    column of the edit-distance table, so each text byte costs a dozen
+    word operations whatever k is.
+  That's still much slower than the memchr-driven exact search, so it
+    only runs near places that could match.  If the literal is cut into
+    k+1 pieces, k edits can spoil at most k of them, so any match holds
+    at least one piece exactly.  The pieces are found with the exact
+    search, and Myers runs over the window each one could be part of.
+*/
+#define MAX_LITERAL 64
+#define MAX_PIECES (MAX_LITERAL/2)
+
+typedef uint64_t word;
+
+struct regapprox
+{
+	word peq[256];	/*bit i set where lit[i] is the byte*/
+	word rpeq[256];	/*same for the literal reversed*/
+	char lit[MAX_LITERAL];
+	int len;
+	int k;
+	int npieces;	/*0 if pieces would be too short to bother*/
+	int piecelen;
+};
+
+/*Column of the table, and the distance at its bottom*/
+struct column
+{
+	word pv, mv;
+	int score;
+};
+
+static void reset(const struct regapprox *ra, struct column *col)
+{
+	col->pv=~(word)0;
+	col->mv=0;
+	col->score=ra->len;
+}
+
+/*Moves col on by one text byte.
+  anchored says the match has to start where the column was reset,
+    rather than anywhere.
+*/
+static void step(const word *peq, int len, struct column *col, unsigned char c, int anchored)
+{
+	word eq=peq[c];
+	word xv=eq | col->mv;
+	word xh=(((eq & col->pv) + col->pv) ^ col->pv) | eq;
+	word ph=col->mv | ~(xh | col->pv);
+	word mh=col->pv & xh;
+	word top=(word)1 << (len-1);
+
+	if(ph & top)
+		col->score++;
+	else if(mh & top)
+		col->score--;
+	ph=(ph << 1) | (word)(anchored != 0);
+	mh<<=1;
+	col->pv=mh | ~(xv | ph);
+	col->mv=ph & xv;
+}
+
+static const char *find_piece(const char *start, const char *stop, const char *piece, size_t len)
+{
+	const char *p;
+
+	while((size_t)(stop - start) >= len)
+	{
+		p=memchr(start, piece[0], (size_t)(stop - start) - len + 1);
+		if(p == NULL)
+			break;
+		if(memcmp(p+1, piece+1, len-1) == 0)
+			return p;
+		start=p+1;
+	}
+	return NULL;
+}
+
+/*Runs col over buf[from, to).
+  Returns the offset just past the first match found, or -1.
+*/
+static long scan(const struct regapprox *ra, struct column *col, const char *buf, size_t from, size_t to)
+{
+	size_t i;
+
+	if(col->score <= ra->k)
+		return (long)from;
+	for(i=from; i < to; i++)
+	{
+		step(ra->peq, ra->len, col, (unsigned char)buf[i], 0);
+		if(col->score <= ra->k)
+			return (long)i+1;
+	}
+	return -1;
+}
+
+/*Having found a match ending at end with col, keeps going while that
+    makes it closer, then works back from the end for the shortest start
+    that's as close.
+*/
+static void finish(const struct regapprox *ra, struct column *col, const char *buf, size_t len, size_t end,
+	regmatch_t *match, int *errors)
+{
+	struct column back, next;
+	size_t start, lo;
+
+	for(;;)
+	{
+		if(end >= len)
+			break;
+		next=*col;
+		step(ra->peq, ra->len, &next, (unsigned char)buf[end], 0);
+		if(next.score >= col->score)
+			break;
+		*col=next;
+		end++;
+	}
+	if(errors != NULL)
+		*errors=col->score;
+	if(match == NULL)
+		return;
+
+	reset(ra, &back);
+	lo=(end > (size_t)(ra->len + ra->k)) ? end - (ra->len + ra->k) : 0;
+	for(start=end; back.score > col->score && start > lo; start--)
+		step(ra->rpeq, ra->len, &back, (unsigned char)buf[start-1], 1);
+	match->rm_so=(regoff_t)start;
+	match->rm_eo=(regoff_t)end;
+}
+
+int regapprox_comp(regapprox_t **rap, const regex_t *preg, int k)
+{
+	struct regapprox *ra;
+	struct reginfo info;
+	int i;
+
+	if(reginfo(preg, &info) != 0)
+		return REG_BADPAT;
+	if(info.pclass != REG_CLASS_LITERAL || info.mlen == 0 || info.mlen > MAX_LITERAL || k < 0)
+		return REG_INVARG;
+	if((ra=calloc(1, sizeof *ra)) == NULL)
+		return REG_ESPACE;
+
+	memcpy(ra->lit, info.must, info.mlen);
+	ra->len=(int)info.mlen;
+	ra->k=k;
+	for(i=0; i < ra->len; i++)
+	{
+		ra->peq[(unsigned char)ra->lit[i]] |= (word)1 << i;
+		ra->rpeq[(unsigned char)ra->lit[ra->len-1-i]] |= (word)1 << i;
+	}
+
+	/*One-byte pieces turn up everywhere; just run Myers over everything*/
+	if(ra->len / (k+1) >= 2)
+	{
+		ra->npieces=k+1;
+		ra->piecelen=ra->len / (k+1);
+	}
+	*rap=ra;
+	return 0;
+}
+
+int regapprox_exec(const regapprox_t *ra, const char *buf, size_t len, regmatch_t *match, int *errors)
+{
+	const char *next[MAX_PIECES];
+	size_t span=(size_t)(ra->len + ra->k);
+	struct column col;
+	size_t scanned=0;
+	int valid=0;
+	long end;
+	int i;
+
+	if(ra->npieces == 0)
+	{
+		reset(ra, &col);
+		end=scan(ra, &col, buf, 0, len);
+		if(end < 0)
+			return REG_NOMATCH;
+		finish(ra, &col, buf, len, (size_t)end, match, errors);
+		return 0;
+	}
+
+	for(i=0; i < ra->npieces; i++)
+		next[i]=find_piece(buf, buf+len, ra->lit + i*ra->piecelen, (size_t)ra->piecelen);
+
+	for(;;)
+	{
+		size_t from, to, at;
+		int best=-1;
+		size_t best_from=0;
+
+		/*The window that starts first next*/
+		for(i=0; i < ra->npieces; i++)
+		{
+			size_t off=(size_t)(i*ra->piecelen);
+			if(next[i] == NULL)
+				continue;
+			at=(size_t)(next[i] - buf);
+			from=(at >= off + ra->k) ? at - off - ra->k : 0;
+			if(best < 0 || from < best_from)
+			{
+				best=i;
+				best_from=from;
+			}
+		}
+		if(best < 0)
+			return REG_NOMATCH;
+
+		at=(size_t)(next[best] - buf) - (size_t)(best*ra->piecelen);
+		to=(at + span < len) ? at + span : len;
+		from=best_from;
+		if(!valid || from > scanned)
+		{
+			reset(ra, &col);
+			valid=1;
+		}
+		else
+			from=scanned;
+		if(to > from)
+		{
+			end=scan(ra, &col, buf, from, to);
+			if(end >= 0)
+			{
+				finish(ra, &col, buf, len, (size_t)end, match, errors);
+				return 0;
+			}
+			scanned=to;
+		}
+
+		/*Skip copies of the piece whose windows are already covered*/
+		from=(size_t)(next[best] - buf) + 1;
+		at=scanned + (size_t)(best*ra->piecelen);
+		if(at >= span && at - span + 1 > from)
+			from=at - span + 1;
+		next[best]=(from < len) ? find_piece(buf+from, buf+len, ra->lit + best*ra->piecelen, (size_t)ra->piecelen) : NULL;
+	}
+}
+
+void regapprox_free(regapprox_t *ra)
+{
+	free(ra);
+}
@@ -0,0 +1,594 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwing.h"
+#include "openbsd.h"
+#include "regex.h"
+
+#include "openbsd/regex/utils.h"
+#include "openbsd/regex/regex2.h"
+
+/*Cache files of compiled patterns.
+
+  A file is a header, the records, then an index of (key, offset) pairs
+    sorted by key.  Everything refers to everything else by offset from
+    the start of the file, and a record holds the strip and set bitmaps
+    exactly as the matcher uses them, so loading a pattern is a binary
+    search, a checksum, and pointing a fresh re_guts into the mapping.
+  A file that doesn't look exactly right (magic, version, layout, byte
+    order, bounds) is ignored, as is any record that fails its checks,
+    and it all gets rewritten on close.  Files are replaced by renaming
+    a complete new one over them, so processes that still have the old
+    one mapped are not disturbed.
+*/
+#define CACHE_VERSION 1
+static const char cache_magic[8]="WINGREX";
+
+/*Anything else that changes the meaning of the bytes in a record*/
+#define CACHE_LAYOUT ((uint32_t)(sizeof(sop) << 24 | OPSHIFT << 16 | NC))
+#define BYTE_ORDER_MARK 0x01020304UL
+
+/*Oldest records are dropped once a file would hold more than this*/
+#define CACHE_MAX_ENTRIES 65536
+
+/*Every section of the file starts on one of these*/
+#define ALIGN(n) (((uint64_t)(n) + 7) & ~(uint64_t)7)
+
+struct cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;
+	uint32_t byteorder;
+	uint32_t nentries;
+	uint64_t index;	/*offset of struct cache_index[nentries]*/
+};
+
+struct cache_index
+{
+	uint64_t key;	/*cache_key() of pattern and flags*/
+	uint64_t offset;	/*of the cache_record*/
+	uint32_t size;	/*of the record and everything after it*/
+	uint32_t check;	/*hash of those size bytes*/
+};
+
+/*Followed by, each aligned:
+    the pattern text (patlen bytes, not terminated)
+    sop strip[nstates]
+    uch setbits[csetsize][ncsets/CHAR_BIT, rounded up]
+    must (mlen bytes and a NUL, only if mlen > 0)
+    prefix (plen bytes and a NUL, only if plen > 0)
+*/
+struct cache_record
+{
+	uint32_t cflags, patlen;
+	uint32_t nstates, firststate, laststate;
+	uint32_t csetsize, ncsets;
+	uint32_t iflags, nbol, neol;
+	uint32_t mlen, plen;
+	uint32_t nsub, backrefs, nplus;
+	uint32_t pclass, engine, prefilter;
+};
+
+/*Offsets of the parts of a record, from the start of the record*/
+struct record_layout
+{
+	uint64_t pattern, strip, setbits, must, prefix, end;
+};
+
+/*A newly compiled pattern, waiting to be written out*/
+struct pending
+{
+	struct pending *next;	/*next older*/
+	struct pending *chain;	/*in the same hash bucket*/
+	struct cache_index ent;	/*offset is not known yet*/
+	uint64_t data[];	/*the record, ent.size bytes*/
+};
+
+struct regcache
+{
+	char *path;
+	struct wing_map map;
+	const struct cache_index *index;	/*into map; NULL if the file is unusable*/
+	uint32_t nentries;
+	struct pending *pending;	/*newest first*/
+	uint32_t npending;
+	struct pending **buckets;	/*pending, hashed by key*/
+	uint32_t nbuckets;
+};
+
+/*Flags that make a difference to the compiled pattern*/
+#define KEY_FLAGS(f) ((uint32_t)(f) & ~(uint32_t)(REG_SHARE|REG_PEND|REG_DUMP))
+
+#define FNV_INIT 14695981039346656037ULL
+
+static uint64_t fnv(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s=p;
+	while(len-- > 0)
+	{
+		h ^= *s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t cache_key(const char *pattern, size_t len, uint32_t flags)
+{
+	return fnv(fnv(FNV_INIT, &flags, sizeof flags), pattern, len);
+}
+
+/*Checksum of a record.  Records are aligned and a whole number of
+  words long, so this can go a word at a time.
+*/
+static uint32_t record_check(const void *record, uint32_t size)
+{
+	const uint64_t *w=record;
+	uint64_t h=FNV_INIT;
+	uint32_t i;
+
+	for(i=0; i < size/8; i++)
+		h=(h ^ w[i]) * 1099511628211ULL;
+	return (uint32_t)(h ^ h>>32);
+}
+
+static uint64_t setbytes(uint32_t csetsize, uint32_t ncsets)
+{
+	return (uint64_t)csetsize * (((uint64_t)ncsets + (CHAR_BIT-1)) / CHAR_BIT);
+}
+
+static void lay_out(const struct cache_record *r, struct record_layout *l)
+{
+	l->pattern=ALIGN(sizeof *r);
+	l->strip=ALIGN(l->pattern + r->patlen);
+	l->setbits=ALIGN(l->strip + (uint64_t)r->nstates * sizeof(sop));
+	l->must=ALIGN(l->setbits + setbytes(r->csetsize, r->ncsets));
+	l->prefix=ALIGN(l->must + (r->mlen > 0 ? (uint64_t)r->mlen + 1 : 0));
+	l->end=ALIGN(l->prefix + (r->plen > 0 ? (uint64_t)r->plen + 1 : 0));
+}
+
+/*Returns the record ent refers to if it lies within the mapped file and
+    passes every check, or NULL.
+  The strip is checked well enough that the matcher can't be sent
+    outside it, even by a file that was damaged behind our back.
+*/
+static const struct cache_record *checked_record(const regcache_t *rc, const struct cache_index *ent)
+{
+	const struct cache_record *r;
+	const char *base;
+	struct record_layout l;
+	const sop *strip;
+	uint32_t i;
+
+	if(ent->offset % 8 != 0 || ent->offset > rc->map.len
+		|| rc->map.len - ent->offset < ent->size || ent->size < sizeof *r)
+		return NULL;
+	base=rc->map.data + ent->offset;
+	r=(const struct cache_record *)base;
+	lay_out(r, &l);
+	if(l.end != ent->size || record_check(base, ent->size) != ent->check)
+		return NULL;
+
+	if(r->csetsize != NC || r->ncsets > INT_MAX || r->mlen > INT_MAX || r->plen > INT_MAX)
+		return NULL;
+	if(r->nstates < 2 || r->firststate >= r->laststate || r->laststate > r->nstates)
+		return NULL;
+	if((r->mlen > 0 && base[l.must + r->mlen] != '\0') || (r->plen > 0 && base[l.prefix + r->plen] != '\0'))
+		return NULL;
+
+	strip=(const sop *)(base + l.strip);
+	for(i=0; i < r->nstates; i++)
+	{
+		unsigned long opnd=OPND(strip[i]);
+		switch(OP(strip[i]))
+		{
+		case OEND: case OCHAR: case OBOL: case OEOL: case OANY: case OBOW: case OEOW:
+		break;
+		case OANYOF:
+			if(opnd >= r->ncsets)
+				return NULL;
+		break;
+		case OBACK_: case O_BACK: case OLPAREN: case ORPAREN:
+			if(opnd > r->nsub)
+				return NULL;
+		break;
+		case OPLUS_: case OQUEST_: case OCH_: case OOR2:
+			if(opnd >= r->nstates - i)
+				return NULL;
+		break;
+		case O_PLUS: case O_QUEST: case OOR1: case O_CH:
+			if(opnd > i)
+				return NULL;
+		break;
+		default:
+			return NULL;
+		}
+	}
+	return r;
+}
+
+/*Returns nonzero if record r was compiled from pattern with flags*/
+static int record_is(const struct cache_record *r, const char *pattern, size_t len, uint32_t flags)
+{
+	return r->cflags == flags && r->patlen == len
+		&& memcmp((const char *)r + ALIGN(sizeof *r), pattern, len) == 0;
+}
+
+/*Finds the record for pattern and flags, in the file or among the
+  patterns compiled since it was opened.  Returns NULL if there is none.
+*/
+static const struct cache_record *lookup(const regcache_t *rc, uint64_t key, const char *pattern, size_t len, uint32_t flags)
+{
+	const struct cache_record *r;
+	const struct pending *pe;
+	uint32_t lo=0, hi=rc->nentries, mid;
+
+	while(lo < hi)
+	{
+		mid=lo + (hi-lo)/2;
+		if(rc->index[mid].key < key)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	for(; lo < rc->nentries && rc->index[lo].key == key; lo++)
+		if((r=checked_record(rc, &rc->index[lo])) != NULL && record_is(r, pattern, len, flags))
+			return r;
+
+	if(rc->nbuckets == 0)
+		return NULL;
+	for(pe=rc->buckets[key % rc->nbuckets]; pe != NULL; pe=pe->chain)
+		if(pe->ent.key == key && record_is((const struct cache_record *)pe->data, pattern, len, flags))
+			return (const struct cache_record *)pe->data;
+	return NULL;
+}
+
+/*Makes preg a compiled pattern that uses r in place*/
+static int load(const struct cache_record *r, regex_t *preg)
+{
+	const char *base=(const char *)r;
+	struct record_layout l;
+	struct re_guts *g;
+	int i;
+
+	if((g=malloc(sizeof *g)) == NULL)
+		return REG_ESPACE;
+	g->sets=NULL;
+	if(r->ncsets > 0 && (g->sets=reallocarray(NULL, r->ncsets, sizeof(cset))) == NULL)
+	{
+		free(g);
+		return REG_ESPACE;
+	}
+	lay_out(r, &l);
+
+	g->strip=(sop *)(base + l.strip);
+	g->csetsize=r->csetsize;
+	g->ncsets=r->ncsets;
+	g->setbits=r->ncsets > 0 ? (uch *)(base + l.setbits) : NULL;
+	/*Same arrangement as regcomp's allocset*/
+	for(i=0; i < g->ncsets; i++)
+	{
+		g->sets[i].ptr=g->setbits + g->csetsize*(i/CHAR_BIT);
+		g->sets[i].mask=1 << (i%CHAR_BIT);
+		g->sets[i].hash=0;
+		g->sets[i].smultis=0;
+		g->sets[i].multis=NULL;
+	}
+	g->cflags=r->cflags;
+	g->nstates=r->nstates;
+	g->firststate=r->firststate;
+	g->laststate=r->laststate;
+	g->iflags=(r->iflags & ~SHARED) | MAPPED;
+	g->nbol=r->nbol;
+	g->neol=r->neol;
+	g->ncategories=0;
+	g->categories=NULL;
+	g->catspace=NULL;
+	g->must=r->mlen > 0 ? (char *)(base + l.must) : NULL;
+	g->mlen=r->mlen;
+	g->nsub=r->nsub;
+	g->backrefs=r->backrefs;
+	g->nplus=r->nplus;
+	g->pclass=r->pclass;
+	g->engine=r->engine;
+	g->prefilter=r->prefilter;
+	g->prefix=r->plen > 0 ? (char *)(base + l.prefix) : NULL;
+	g->plen=r->plen;
+	g->magic=MAGIC2;
+
+	preg->re_nsub=g->nsub;
+	preg->re_g=g;
+	preg->re_magic=MAGIC1;
+	return 0;
+}
+
+/*Doubles the pending hash table.  Returns 0 if memory runs out.*/
+static int grow_buckets(regcache_t *rc)
+{
+	uint32_t n=rc->nbuckets == 0 ? 64 : rc->nbuckets * 2;
+	struct pending **b;
+	struct pending *pe;
+
+	if((b=calloc(n, sizeof *b)) == NULL)
+		return 0;
+	for(pe=rc->pending; pe != NULL; pe=pe->next)
+	{
+		pe->chain=b[pe->ent.key % n];
+		b[pe->ent.key % n]=pe;
+	}
+	free(rc->buckets);
+	rc->buckets=b;
+	rc->nbuckets=n;
+	return 1;
+}
+
+/*Keeps a copy of the freshly compiled g for regcache_close to write.
+  Caching is an optimization, so if this fails nothing is said.
+*/
+static void remember(regcache_t *rc, uint64_t key, const struct re_guts *g, const char *pattern, size_t len, uint32_t flags)
+{
+	struct cache_record r;
+	struct record_layout l;
+	struct pending *pe;
+	char *base;
+
+	if(len > UINT32_MAX || (uint64_t)g->nstates > UINT32_MAX)
+		return;
+	r.cflags=flags;
+	r.patlen=len;
+	r.nstates=g->nstates;
+	r.firststate=g->firststate;
+	r.laststate=g->laststate;
+	r.csetsize=g->csetsize;
+	r.ncsets=g->ncsets;
+	r.iflags=g->iflags & ~SHARED;
+	r.nbol=g->nbol;
+	r.neol=g->neol;
+	r.mlen=g->mlen;
+	r.plen=g->plen;
+	r.nsub=g->nsub;
+	r.backrefs=g->backrefs;
+	r.nplus=g->nplus;
+	r.pclass=g->pclass;
+	r.engine=g->engine;
+	r.prefilter=g->prefilter;
+	lay_out(&r, &l);
+	if(l.end > UINT32_MAX || (pe=malloc(sizeof *pe + l.end)) == NULL)
+		return;
+
+	/*Zero the padding too, so the checksum is reproducible*/
+	base=(char *)pe->data;
+	memset(base, 0, l.end);
+	memcpy(base, &r, sizeof r);
+	memcpy(base + l.pattern, pattern, len);
+	memcpy(base + l.strip, g->strip, (size_t)g->nstates * sizeof(sop));
+	if(g->setbits != NULL)
+		memcpy(base + l.setbits, g->setbits, setbytes(r.csetsize, r.ncsets));
+	if(g->mlen > 0)
+		memcpy(base + l.must, g->must, g->mlen);
+	if(g->plen > 0)
+		memcpy(base + l.prefix, g->prefix, g->plen);
+
+	pe->ent.key=key;
+	pe->ent.offset=0;
+	pe->ent.size=l.end;
+	pe->ent.check=record_check(base, l.end);
+	if(rc->npending >= rc->nbuckets && !grow_buckets(rc) && rc->nbuckets == 0)
+	{
+		free(pe);
+		return;
+	}
+	pe->chain=rc->buckets[key % rc->nbuckets];
+	rc->buckets[key % rc->nbuckets]=pe;
+	pe->next=rc->pending;
+	rc->pending=pe;
+	rc->npending++;
+}
+
+/*Returns nonzero if the mapped file is one we can use*/
+static int use_file(regcache_t *rc)
+{
+	const struct cache_header *h=(const struct cache_header *)rc->map.data;
+
+	if(rc->map.len < sizeof *h)
+		return 0;
+	if(memcmp(h->magic, cache_magic, sizeof h->magic) != 0 || h->version != CACHE_VERSION
+		|| h->layout != CACHE_LAYOUT || h->byteorder != BYTE_ORDER_MARK)
+		return 0;
+	if(h->index % 8 != 0 || h->index > rc->map.len
+		|| (rc->map.len - h->index) / sizeof *rc->index < h->nentries)
+		return 0;
+	rc->index=(const struct cache_index *)(rc->map.data + h->index);
+	rc->nentries=h->nentries;
+	return 1;
+}
+
+regcache_t *regcache_open(const char *path)
+{
+	regcache_t *rc;
+	FILE *f;
+
+	if((rc=malloc(sizeof *rc)) == NULL)
+		return NULL;
+	if((rc->path=malloc(strlen(path)+1)) == NULL)
+	{
+		free(rc);
+		return NULL;
+	}
+	strcpy(rc->path, path);
+	rc->map.data=NULL;
+	rc->map.len=0;
+	rc->index=NULL;
+	rc->nentries=0;
+	rc->pending=NULL;
+	rc->npending=0;
+	rc->buckets=NULL;
+	rc->nbuckets=0;
+
+	if((f=fopen(path, "rb")) != NULL)
+	{
+		if(wing_map(f, &rc->map) == 0 && !use_file(rc))
+			wing_unmap(&rc->map);
+		fclose(f);
+	}
+	return rc;
+}
+
+int regcache_comp(regcache_t *rc, regex_t *preg, const char *pattern, int cflags)
+{
+	uint32_t flags=KEY_FLAGS(cflags);
+	const struct cache_record *r;
+	uint64_t key;
+	size_t len;
+	int ret;
+
+	if(cflags&REG_PEND)
+	{
+		if(preg->re_endp < pattern)
+			return REG_INVARG;
+		len=preg->re_endp - pattern;
+	}
+	else
+		len=strlen(pattern);
+
+	key=cache_key(pattern, len, flags);
+	if((r=lookup(rc, key, pattern, len, flags)) != NULL)
+		return load(r, preg);
+	if((ret=regcomp(preg, pattern, cflags)) == 0)
+		remember(rc, key, preg->re_g, pattern, len, flags);
+	return ret;
+}
+
+/*A record to be written out, and where it comes from*/
+struct source
+{
+	struct cache_index ent;
+	const char *data;
+};
+
+static int by_offset(const void *va, const void *vb)
+{
+	const struct source *a=va, *b=vb;
+	return (a->ent.offset > b->ent.offset) - (a->ent.offset < b->ent.offset);
+}
+
+static int by_key(const void *va, const void *vb)
+{
+	const struct source *a=va, *b=vb;
+	return (a->ent.key > b->ent.key) - (a->ent.key < b->ent.key);
+}
+
+/*Writes the usable records of the old file followed by the new ones,
+    oldest first, dropping the oldest if there are too many, then the
+    index.
+  Returns 0 on success, -1 on error.
+*/
+static int write_cache(regcache_t *rc, FILE *out)
+{
+	struct cache_header h;
+	struct source *src;
+	const struct pending *pe;
+	uint32_t n=0, i, drop=0;
+	uint64_t offset;
+
+	if((src=reallocarray(NULL, rc->nentries + (size_t)rc->npending, sizeof *src)) == NULL)
+		return -1;
+	for(i=0; i < rc->nentries; i++)
+		if(checked_record(rc, &rc->index[i]) != NULL)
+		{
+			src[n].ent=rc->index[i];
+			src[n].data=rc->map.data + rc->index[i].offset;
+			n++;
+		}
+	/*The old file has them oldest first; pending is newest first*/
+	qsort(src, n, sizeof *src, by_offset);
+	n += rc->npending;
+	for(pe=rc->pending, i=n; pe != NULL; pe=pe->next)
+	{
+		i--;
+		src[i].ent=pe->ent;
+		src[i].data=(const char *)pe->data;
+	}
+	if(n > CACHE_MAX_ENTRIES)
+		drop=n - CACHE_MAX_ENTRIES;
+
+	offset=sizeof h;
+	for(i=drop; i < n; i++)
+	{
+		src[i].ent.offset=offset;
+		offset += src[i].ent.size;
+	}
+
+	memcpy(h.magic, cache_magic, sizeof h.magic);
+	h.version=CACHE_VERSION;
+	h.layout=CACHE_LAYOUT;
+	h.byteorder=BYTE_ORDER_MARK;
+	h.nentries=n - drop;
+	h.index=offset;
+	fwrite(&h, sizeof h, 1, out);
+	for(i=drop; i < n; i++)
+		fwrite(src[i].data, 1, src[i].ent.size, out);
+	qsort(src + drop, n - drop, sizeof *src, by_key);
+	for(i=drop; i < n; i++)
+		fwrite(&src[i].ent, sizeof src[i].ent, 1, out);
+
+	free(src);
+	return ferror(out) ? -1 : 0;
+}
+
+/*Writes a new file next to the old one, and renames it into place.
+  Unmaps the old file whatever happens.
+*/
+static int replace_file(regcache_t *rc)
+{
+	char *tmp;
+	FILE *out;
+	int errno_save=0;
+
+	if((out=wing_replace_open(rc->path, &tmp)) == NULL)
+	{
+		errno_save=errno;
+		wing_unmap(&rc->map);
+		errno=errno_save;
+		return -1;
+	}
+	errno=0;
+	if(write_cache(rc, out) != 0)
+		errno_save=errno ? errno : EIO;
+	if(fclose(out) != 0 && errno_save == 0)
+		errno_save=errno ? errno : EIO;
+
+	/*Win32 can't replace a file that is mapped*/
+	wing_unmap(&rc->map);
+	if(errno_save == 0 && wing_replace(tmp, rc->path) != 0)
+		errno_save=errno;
+	if(errno_save != 0)
+		remove(tmp);
+	free(tmp);
+	errno=errno_save;
+	return errno_save == 0 ? 0 : -1;
+}
+
+int regcache_close(regcache_t *rc)
+{
+	struct pending *pe, *next;
+	int ret=0;
+
+	if(rc->npending > 0)
+		ret=replace_file(rc);
+	else
+		wing_unmap(&rc->map);
+	for(pe=rc->pending; pe != NULL; pe=next)
+	{
+		next=pe->next;
+		free(pe);
+	}
+	free(rc->buckets);
+	free(rc->path);
+	free(rc);
+	return ret;
+}
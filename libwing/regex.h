@@ -1 +1,196 @@
+#ifndef H_LIBWING_REGEX
+#define H_LIBWING_REGEX
+
+#include <stdio.h>
+
 #include "openbsd/regex.h"
+
+/*WING extensions to the regex interface*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*Extra regcomp() flag: keep character-set bitmaps in a process-wide
+    pool shared with every other pattern compiled with REG_SHARE.
+  This saves a lot of memory for big sets of similar patterns, but
+    regcomp() and regfree() calls on such patterns must not run
+    concurrently.  regexec() is unaffected.
+*/
+#define REG_SHARE	01000
+
+/*Extra regcomp() flag: the pattern and the strings it will be matched
+    against are UTF-8.  . and [] match whole characters, and a multibyte
+    character in the pattern is a single atom for *, + and the like.
+    Matching still goes a byte at a time, so no decoding is done and
+    offsets are byte offsets.
+  Only ASCII letters are affected by REG_ICASE, and only ASCII
+    characters are in [:classes:] or count as word characters.
+    Malformed UTF-8 in a [] is an error (REG_ECOLLATE).
+*/
+#define REG_UTF8	02000
+
+/*Extra regcomp() flags: the pattern only matches where \< and \> would
+    at its ends (REG_WORD), or only a whole line, as though it were
+    wrapped in ^( and )$ (REG_LINE).  They're compiled into the pattern,
+    so matching still takes a single pass.  REG_LINE wins if both are
+    given.
+  With REG_WORD, a pattern that starts or ends with a non-word character
+    can't match there, since \< and \> only fall next to word
+    characters.
+*/
+#define REG_WORD	04000
+#define REG_LINE	010000
+
+/*Pattern classes, as decided by regcomp's planner.*/
+#define REG_CLASS_LITERAL	1	/*nothing but ordinary characters*/
+#define REG_CLASS_ANCHORED	2	/*literal pinned by ^, $, \< or \>*/
+#define REG_CLASS_PREFIXED	3	/*every match starts with a literal*/
+#define REG_CLASS_SMALL	4	/*NFA that fits in a machine word*/
+#define REG_CLASS_LARGE	5	/*NFA that needs a state array*/
+#define REG_CLASS_BACKREF	6	/*uses back references*/
+
+/*Execution engines*/
+#define REG_ENGINE_LITERAL	1	/*substring search, no automaton*/
+#define REG_ENGINE_ANCHORED	2	/*compare at the ends, or check the anchors at each copy*/
+#define REG_ENGINE_SMALL	3	/*bit-parallel state sets*/
+#define REG_ENGINE_LARGE	4	/*byte-per-state state sets*/
+
+/*Prefilters run before the engine*/
+#define REG_PREFILTER_NONE	0
+#define REG_PREFILTER_MUST	1	/*reject if a required literal is absent*/
+#define REG_PREFILTER_PREFIX	2	/*skip ahead to the literal prefix*/
+
+/*What the planner knows about a compiled pattern.
+  must and prefix point into the compiled pattern and are only valid
+    until it is regfree'd; they are NOT nul-terminated.
+*/
+struct reginfo
+{
+	int pclass;
+	int engine;
+	int prefilter;
+	int backrefs;
+	size_t nstates;
+	size_t ncsets;
+	const char *must;
+	size_t mlen;
+	const char *prefix;
+	size_t plen;
+	size_t maxlen;	/*longest text a match can cover, or (size_t)-1 if there's no limit*/
+	size_t footprint;	/*bytes of memory held, counting shared sets fractionally*/
+};
+
+/*Fills in *info for preg.
+  Returns 0 on success, or REG_BADPAT if preg is not a valid compiled
+    pattern.
+*/
+int reginfo(const regex_t *preg, struct reginfo *info);
+
+/*Writes a human-readable description of preg to out: the pattern class,
+    engine and prefilter the planner chose, the compiled strip, and the
+    character categories.
+  Returns 0 on success, or REG_BADPAT if preg is not a valid compiled
+    pattern.
+*/
+int regexplain(const regex_t *preg, FILE *out);
+
+/*State for walking through every match in a buffer.  The members are
+    private; use regiter_init, regiter_next and regiter_seek.
+*/
+typedef struct
+{
+	const regex_t *preg;
+	const char *buf;
+	size_t len;
+	int eflags;
+	size_t pos;	/*where the next search starts; len+1 when done*/
+	size_t prev_end;	/*end of the last match, or (size_t)-1*/
+	const char *prefix_at;	/*where the prefilter last found its literals*/
+	const char *must_at;
+} regiter_t;
+
+/*Sets up *it to find the non-overlapping matches of preg in the len
+    bytes at buf, which needn't be nul-terminated and may contain nuls.
+  Only REG_NOTBOL and REG_NOTEOL are honoured in eflags; they apply to
+    the ends of the whole buffer.
+  Nothing is copied: buf and preg must outlive the iterator.
+*/
+void regiter_init(regiter_t *it, const regex_t *preg, const char *buf, size_t len, int eflags);
+
+/*Finds the next match, filling in pmatch like regexec with offsets from
+    the start of the buffer.  nmatch may be 0.
+  Searching resumes where the previous match ended and sees the text
+    before it, so ^, \< and \> work as they would on a single regexec.
+    An empty match next to the previous match is skipped, and after an
+    empty match the search moves on one character (a whole character
+    with REG_UTF8).
+  Returns 0 on a match, REG_NOMATCH when there are no more, or another
+    REG_ error code.
+*/
+int regiter_next(regiter_t *it, size_t nmatch, regmatch_t pmatch[]);
+
+/*Makes the next regiter_next search start at offset pos, which had
+    better be at a character boundary.  Seeking past the end finishes
+    the iteration.
+*/
+void regiter_seek(regiter_t *it, size_t pos);
+
+/*Approximate search for a literal pattern: finds text within k edits
+    (bytes inserted, deleted or changed) of it.
+*/
+typedef struct regapprox regapprox_t;
+
+/*Sets *rap up to search for the literal that preg matches.  preg must
+    be a plain literal (reginfo says REG_CLASS_LITERAL) of at most 64
+    bytes.
+  Returns 0 on success, REG_INVARG if preg or k won't do, REG_BADPAT if
+    preg is not a valid compiled pattern, or REG_ESPACE.  preg can be
+    regfree'd afterwards.
+*/
+int regapprox_comp(regapprox_t **rap, const regex_t *preg, int k);
+
+/*Finds the match in the len bytes at buf that ends first, and, if
+    match isn't NULL, puts its bounds there.  The match is stretched
+    while that lowers the number of edits, then cut down to the shortest
+    start with that many; the number goes in *errors if errors isn't
+    NULL.
+  Returns 0 on a match, or REG_NOMATCH.
+*/
+int regapprox_exec(const regapprox_t *ra, const char *buf, size_t len, regmatch_t *match, int *errors);
+
+void regapprox_free(regapprox_t *ra);
+
+/*A file of compiled patterns, kept between runs so that programs which
+    compile the same big pattern sets every time start up quickly.
+*/
+typedef struct regcache regcache_t;
+
+/*Opens the cache file at path.  A missing, unreadable, damaged or
+    out-of-date file is not an error; the cache just starts out empty.
+  Returns NULL only if memory runs out.
+*/
+regcache_t *regcache_open(const char *path);
+
+/*Like regcomp, but takes the compiled pattern from the cache when it's
+    there.  Such patterns point into the cache file instead of owning
+    their memory, so they must all be regfree'd before the cache is
+    closed.  REG_SHARE is ignored for them; the mapped file is already
+    shared.
+  Patterns that have to be compiled are remembered, and written out by
+    regcache_close.
+*/
+int regcache_comp(regcache_t *rc, regex_t *preg, const char *pattern, int cflags);
+
+/*Writes out the patterns compiled since the cache was opened, if there
+    were any, and frees the cache.
+  Returns 0 on success, or -1 with errno set if the file couldn't be
+    written.  The cache is freed either way.
+*/
+int regcache_close(regcache_t *rc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/*H_LIBWING_REGEX #include guard*/
@@ -0,0 +1,303 @@
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+
+#include "regex.h"
+
+#include "openbsd/regex/utils.h"
+#include "openbsd/regex/regex2.h"
+
+static const char *class_names[] =
+{
+	"invalid",
+	"literal",
+	"anchored literal",
+	"literal-prefixed",
+	"small NFA",
+	"large NFA",
+	"backreference",
+};
+
+static const char *engine_names[] =
+{
+	"invalid",
+	"literal (substring search)",
+	"anchored (compare at ends)",
+	"small (bit-parallel state sets)",
+	"large (byte-per-state state sets)",
+};
+
+static const char *op_names[] =
+{
+	"?0", "END", "CHAR", "BOL", "EOL", "ANY", "ANYOF", "BACK_", "_BACK",
+	"PLUS_", "_PLUS", "QUEST_", "_QUEST", "LPAREN", "RPAREN", "CH_",
+	"OR1", "OR2", "_CH", "BOW", "EOW",
+};
+
+static const char *name_of(const char **names, size_t n, int i)
+{
+	if(i < 0 || (size_t)i >= n)
+		return names[0];
+	return names[i];
+}
+#define NAME_OF(names, i) name_of(names, sizeof names / sizeof names[0], (i))
+
+static struct re_guts *valid_guts(const regex_t *preg)
+{
+	struct re_guts *g=preg->re_g;
+	if(preg->re_magic != MAGIC1 || g == NULL || g->magic != MAGIC2)
+		return NULL;
+	return g;
+}
+
+static void put_char(int c, FILE *out)
+{
+	c=(unsigned char)c;
+	if(c == '\\' || c == '"')
+		fprintf(out, "\\%c", c);
+	else if(isprint(c))
+		putc(c, out);
+	else
+		fprintf(out, "\\%03o", c);
+}
+
+static void put_literal(const char *s, size_t len, FILE *out)
+{
+	putc('"', out);
+	while(len-- > 0)
+		put_char(*s++, out);
+	putc('"', out);
+}
+
+/*Prints a cset as a bracket expression, collapsing runs into ranges*/
+static void put_set(const struct re_guts *g, const cset *cs, FILE *out)
+{
+	int c;
+	int first;
+
+	putc('[', out);
+	for(c=0; c < g->csetsize; c++)
+	{
+		if(!CHIN(cs, c))
+			continue;
+		first=c;
+		while(c+1 < g->csetsize && CHIN(cs, c+1))
+			c++;
+		put_char(first, out);
+		if(c > first+1)
+			putc('-', out);
+		if(c > first)
+			put_char(c, out);
+	}
+	putc(']', out);
+}
+
+static void put_strip(const struct re_guts *g, FILE *out)
+{
+	sopno i;
+
+	fprintf(out, "strip (%ld states):\n", (long)g->nstates);
+	for(i=0; i < g->nstates; i++)
+	{
+		sop s=g->strip[i];
+		unsigned long opnd=OPND(s);
+
+		fprintf(out, "  %4ld  %s", (long)i, NAME_OF(op_names, (int)(OP(s)>>OPSHIFT)));
+		switch(OP(s))
+		{
+		case OCHAR:
+			fputs("\t'", out);
+			put_char((char)opnd, out);
+			putc('\'', out);
+		break;
+		case OANYOF:
+			fprintf(out, "\tset %lu ", opnd);
+			put_set(g, &g->sets[opnd], out);
+		break;
+		case OBACK_: case O_BACK: case OLPAREN: case ORPAREN:
+			fprintf(out, "\t%lu", opnd);
+		break;
+		case OPLUS_: case OQUEST_: case OCH_: case OOR2:
+			fprintf(out, "\t->%ld", (long)(i+opnd));
+		break;
+		case O_PLUS: case O_QUEST: case OOR1: case O_CH:
+			fprintf(out, "\t<-%ld", (long)(i-opnd));
+		break;
+		}
+		putc('\n', out);
+	}
+}
+
+/*Categories are only worked out on demand*/
+static void put_categories(struct re_guts *g, FILE *out)
+{
+	int cat;
+	int c;
+
+	if(re_categorize(g) != 0)
+	{
+		fputs("categories: out of memory\n", out);
+		return;
+	}
+	fprintf(out, "categories (%d):\n", g->ncategories);
+	fputs("  0: everything else\n", out);
+	for(cat=1; cat < g->ncategories; cat++)
+	{
+		fprintf(out, "  %d: ", cat);
+		for(c=CHAR_MIN; c <= CHAR_MAX; c++)
+			if(g->categories[c] == cat)
+				put_char(c, out);
+		putc('\n', out);
+	}
+}
+
+/*Bytes held by g, not counting malloc overhead.
+  Bitmaps in the REG_SHARE pool are split evenly between their users.
+  Patterns loaded from a regcache only hold their sets and categories;
+    the rest is in the mapped file.
+*/
+static size_t footprint(const struct re_guts *g)
+{
+	size_t setbytes=(size_t)g->csetsize * ((g->ncsets + (CHAR_BIT-1)) / CHAR_BIT);
+	size_t n=sizeof *g;
+
+	n += (size_t)g->ncsets * sizeof(cset);
+	if(g->catspace != NULL)
+		n += NC * sizeof(cat_t);
+	if(g->iflags&MAPPED)
+		return n;
+	n += (size_t)g->nstates * sizeof(sop);
+	if(g->setbits != NULL && (g->iflags&SHARED))
+		n += setbytes / re_setpool_refs(g->setbits, setbytes);
+	else if(g->setbits != NULL)
+		n += setbytes;
+	if(g->must != NULL)
+		n += g->mlen + 1;
+	if(g->prefix != NULL)
+		n += g->plen + 1;
+	return n;
+}
+
+/*Bytes of text the ops from up to to can match at most, or (size_t)-1
+  if there's no limit.  REG_UTF8 characters are already separate bytes
+  in the strip.
+*/
+static size_t longest(const struct re_guts *g, sopno from, sopno to)
+{
+	size_t n=0;
+	size_t alt;
+	size_t best;
+	sopno i;
+	sopno next;
+
+	for(i=from; i < to; i++)
+	{
+		sop s=g->strip[i];
+		switch(OP(s))
+		{
+		case OCHAR: case OANY: case OANYOF:
+			n++;
+		break;
+		case OPLUS_: case OBACK_:
+			return (size_t)-1;
+		case OQUEST_:
+			if((alt=longest(g, i+1, i+(sopno)OPND(s))) == (size_t)-1)
+				return alt;
+			n+=alt;
+			i+=(sopno)OPND(s);
+		break;
+		case OCH_:
+			/*Each branch ends at the OR1 before the next OR2, or at the _CH*/
+			best=0;
+			do
+			{
+				next=i+(sopno)OPND(g->strip[i]);
+				alt=longest(g, i+1, (OP(g->strip[next]) == OOR2) ? next-1 : next);
+				if(alt == (size_t)-1)
+					return alt;
+				if(alt > best)
+					best=alt;
+				i=next;
+			}
+			while(OP(g->strip[i]) != O_CH);
+			n+=best;
+		break;
+		}
+	}
+	return n;
+}
+
+int reginfo(const regex_t *preg, struct reginfo *info)
+{
+	struct re_guts *g=valid_guts(preg);
+	if(g == NULL)
+		return REG_BADPAT;
+
+	info->pclass=g->pclass;
+	info->engine=g->engine;
+	info->prefilter=g->prefilter;
+	info->backrefs=g->backrefs;
+	info->nstates=g->nstates;
+	info->ncsets=g->ncsets;
+	info->must=g->must;
+	info->mlen=g->mlen;
+	info->prefix=g->prefix;
+	info->plen=g->plen;
+	info->maxlen=longest(g, 1, g->nstates-1);
+	info->footprint=footprint(g);
+	return 0;
+}
+
+int regexplain(const regex_t *preg, FILE *out)
+{
+	struct re_guts *g=valid_guts(preg);
+	size_t maxlen;
+	if(g == NULL)
+		return REG_BADPAT;
+
+	fprintf(out, "class: %s\n", NAME_OF(class_names, g->pclass));
+	fprintf(out, "engine: %s\n", NAME_OF(engine_names, g->engine));
+	fputs("prefilter: ", out);
+	switch(g->prefilter)
+	{
+	case REG_PREFILTER_MUST:
+		fputs("required literal ", out);
+		put_literal(g->must, g->mlen, out);
+	break;
+	case REG_PREFILTER_PREFIX:
+		fputs("skip to prefix ", out);
+		put_literal(g->prefix, g->plen, out);
+		if(g->mlen > g->plen)
+		{
+			fputs(", then required literal ", out);
+			put_literal(g->must, g->mlen, out);
+		}
+	break;
+	default:
+		fputs("none", out);
+	break;
+	}
+	putc('\n', out);
+	fprintf(out, "flags:%s%s%s%s%s%s%s%s%s%s\n",
+		(g->cflags&REG_EXTENDED) ? " extended" : (g->cflags&REG_NOSPEC) ? " nospec" : " basic",
+		(g->cflags&REG_ICASE) ? " icase" : "",
+		(g->cflags&REG_NEWLINE) ? " newline" : "",
+		(g->cflags&REG_UTF8) ? " utf8" : "",
+		(g->cflags&REG_WORD) ? " word" : "",
+		(g->cflags&REG_LINE) ? " line" : "",
+		(g->cflags&REG_SHARE) ? " share" : "",
+		(g->iflags&ANCHOR) ? " anchored" : "",
+		(g->iflags&MAPPED) ? " cached" : "",
+		g->backrefs ? " backrefs" : "");
+	fprintf(out, "subexpressions: %lu, + nesting: %ld, sets: %d\n",
+		(unsigned long)g->nsub, (long)g->nplus, g->ncsets);
+	maxlen=longest(g, 1, g->nstates-1);
+	if(maxlen == (size_t)-1)
+		fputs("longest match: unbounded\n", out);
+	else
+		fprintf(out, "longest match: %lu bytes\n", (unsigned long)maxlen);
+	put_strip(g, out);
+	put_categories(g, out);
+	fprintf(out, "footprint: %lu bytes\n", (unsigned long)footprint(g));
+	return 0;
+}
@@ -0,0 +1,120 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libwing.h"
+
+struct wing_thread
+{
+	pthread_t thread;
+	void (*func)(void *arg);
+	void *arg;
+};
+
+struct wing_mutex
+{
+	pthread_mutex_t mutex;
+};
+
+struct wing_cond
+{
+	pthread_cond_t cond;
+};
+
+static void *run(void *vt)
+{
+	struct wing_thread *t=vt;
+	t->func(t->arg);
+	return NULL;
+}
+
+struct wing_thread *wing_thread_start(void (*func)(void *arg), void *arg)
+{
+	struct wing_thread *t=malloc(sizeof *t);
+	if(t == NULL)
+		return NULL;
+	t->func=func;
+	t->arg=arg;
+	if(pthread_create(&t->thread, NULL, run, t) != 0)
+	{
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void wing_thread_join(struct wing_thread *t)
+{
+	pthread_join(t->thread, NULL);
+	free(t);
+}
+
+struct wing_mutex *wing_mutex_new(void)
+{
+	struct wing_mutex *m=malloc(sizeof *m);
+	if(m == NULL)
+		return NULL;
+	if(pthread_mutex_init(&m->mutex, NULL) != 0)
+	{
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+void wing_mutex_lock(struct wing_mutex *m)
+{
+	pthread_mutex_lock(&m->mutex);
+}
+
+void wing_mutex_unlock(struct wing_mutex *m)
+{
+	pthread_mutex_unlock(&m->mutex);
+}
+
+void wing_mutex_free(struct wing_mutex *m)
+{
+	pthread_mutex_destroy(&m->mutex);
+	free(m);
+}
+
+struct wing_cond *wing_cond_new(void)
+{
+	struct wing_cond *c=malloc(sizeof *c);
+	if(c == NULL)
+		return NULL;
+	if(pthread_cond_init(&c->cond, NULL) != 0)
+	{
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void wing_cond_wait(struct wing_cond *c, struct wing_mutex *m)
+{
+	pthread_cond_wait(&c->cond, &m->mutex);
+}
+
+void wing_cond_broadcast(struct wing_cond *c)
+{
+	pthread_cond_broadcast(&c->cond);
+}
+
+void wing_cond_free(struct wing_cond *c)
+{
+	pthread_cond_destroy(&c->cond);
+	free(c);
+}
+
+int wing_ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n=sysconf(_SC_NPROCESSORS_ONLN);
+	if(n > 0)
+		return (int)n;
+#endif
+	return 1;
+}
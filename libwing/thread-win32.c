@@ -0,0 +1,119 @@
+/*Condition variables need Vista or later*/
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+#include <windows.h>
+#include <process.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libwing.h"
+
+struct wing_thread
+{
+	HANDLE thread;
+	void (*func)(void *arg);
+	void *arg;
+};
+
+struct wing_mutex
+{
+	CRITICAL_SECTION cs;
+};
+
+struct wing_cond
+{
+	CONDITION_VARIABLE cv;
+};
+
+static unsigned __stdcall run(void *vt)
+{
+	struct wing_thread *t=vt;
+	t->func(t->arg);
+	return 0;
+}
+
+struct wing_thread *wing_thread_start(void (*func)(void *arg), void *arg)
+{
+	struct wing_thread *t=malloc(sizeof *t);
+	uintptr_t h;
+
+	if(t == NULL)
+		return NULL;
+	t->func=func;
+	t->arg=arg;
+	/*Not CreateThread, so the C library sets up for the new thread*/
+	h=_beginthreadex(NULL, 0, run, t, 0, NULL);
+	if(h == 0)
+	{
+		free(t);
+		return NULL;
+	}
+	t->thread=(HANDLE)h;
+	return t;
+}
+
+void wing_thread_join(struct wing_thread *t)
+{
+	WaitForSingleObject(t->thread, INFINITE);
+	CloseHandle(t->thread);
+	free(t);
+}
+
+struct wing_mutex *wing_mutex_new(void)
+{
+	struct wing_mutex *m=malloc(sizeof *m);
+	if(m == NULL)
+		return NULL;
+	InitializeCriticalSection(&m->cs);
+	return m;
+}
+
+void wing_mutex_lock(struct wing_mutex *m)
+{
+	EnterCriticalSection(&m->cs);
+}
+
+void wing_mutex_unlock(struct wing_mutex *m)
+{
+	LeaveCriticalSection(&m->cs);
+}
+
+void wing_mutex_free(struct wing_mutex *m)
+{
+	DeleteCriticalSection(&m->cs);
+	free(m);
+}
+
+struct wing_cond *wing_cond_new(void)
+{
+	struct wing_cond *c=malloc(sizeof *c);
+	if(c == NULL)
+		return NULL;
+	InitializeConditionVariable(&c->cv);
+	return c;
+}
+
+void wing_cond_wait(struct wing_cond *c, struct wing_mutex *m)
+{
+	SleepConditionVariableCS(&c->cv, &m->cs, INFINITE);
+}
+
+void wing_cond_broadcast(struct wing_cond *c)
+{
+	WakeAllConditionVariable(&c->cv);
+}
+
+void wing_cond_free(struct wing_cond *c)
+{
+	/*Condition variables hold no resources*/
+	free(c);
+}
+
+int wing_ncpus(void)
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (si.dwNumberOfProcessors > 0) ? (int)si.dwNumberOfProcessors : 1;
+}
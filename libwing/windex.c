@@ -0,0 +1,560 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libwing.h"
+#include "openbsd.h"
+#include "windex.h"
+
+/*Index files.
+
+  A file is a header, the files (name, size and modification time,
+    numbered in the order they were added), the file numbers sorted by
+    name, the names, the trigrams present in order, and each trigram's
+    postings.
+  Postings are the numbers of the files a trigram is in, in order, each
+    as its gap from the one before, seven bits a byte, low bits first,
+    with the top bit set on all but the last byte.  Most gaps are small
+    enough for a byte, which makes the postings several times smaller
+    than the file numbers themselves.
+  As with the regex cache, the file is in the host's own byte order and
+    layout, and one that doesn't look exactly right isn't used.
+*/
+#define INDEX_VERSION 1
+static const char index_magic[8]="WINDEX";
+#define BYTE_ORDER_MARK 0x01020304UL
+
+#define ALIGN(n) (((uint64_t)(n) + 7) & ~(uint64_t)7)
+
+/*A trigram is its three bytes, the first in bits 16-23*/
+#define NTRIGRAMS ((uint32_t)1 << 24)
+#define TRIGRAM(t, c) (((t) << 8 | (unsigned char)(c)) & (NTRIGRAMS-1))
+
+struct index_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t nfiles;
+	uint32_t ntrigrams;
+	uint64_t files;	/*offset of struct index_file[nfiles]*/
+	uint64_t byname;	/*offset of uint32_t[nfiles]*/
+	uint64_t trigrams;	/*offset of struct index_trigram[ntrigrams]*/
+};
+
+struct index_file
+{
+	uint64_t name;	/*offset of the name, nul-terminated*/
+	uint64_t size;
+	int64_t mtime;
+};
+
+struct index_trigram
+{
+	uint32_t trigram;
+	uint32_t nfiles;
+	uint64_t postings;	/*offset*/
+	uint64_t len;	/*of the postings, in bytes*/
+};
+
+/*A trigram's postings, as they're built*/
+struct posting
+{
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	uint32_t last;	/*the last file number added*/
+	uint32_t nfiles;
+};
+
+struct entry
+{
+	char *name;
+	struct wing_stamp stamp;
+};
+
+struct windex_builder
+{
+	uint32_t *slot;	/*for each trigram, 1 + where it is in lists, or 0*/
+	struct posting *lists;
+	uint32_t nlists;
+	uint32_t alists;
+	unsigned char *seen;	/*bitmap of the trigrams in the file being added*/
+	uint32_t *found;	/*the same trigrams, in a list*/
+	size_t afound;
+	struct entry *files;
+	uint32_t nfiles;
+	uint32_t afiles;
+	int err;	/*errno from an add that failed halfway; such an index is no good*/
+};
+
+struct windex
+{
+	struct wing_map map;
+	uint32_t nfiles;
+	uint32_t ntrigrams;
+	const struct index_file *files;
+	const uint32_t *byname;
+	const struct index_trigram *trigrams;
+	unsigned char *candidates;	/*bitmap of the files that might match*/
+	unsigned char *holding;	/*bitmap of the files holding a trigram*/
+};
+
+#define BITMAP_BYTES(n) (((size_t)(n) + 7) / 8)
+#define TEST(map, i) ((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define SET(map, i) ((map)[(i) >> 3] |= (unsigned char)(1 << ((i) & 7)))
+#define CLEAR(map, i) ((map)[(i) >> 3] &= (unsigned char)~(1 << ((i) & 7)))
+
+windex_builder_t *windex_build_start(void)
+{
+	windex_builder_t *b=calloc(1, sizeof *b);
+
+	if(b == NULL)
+		return NULL;
+	/*calloc'd pages cost nothing until a trigram lands on them*/
+	if((b->slot=calloc(NTRIGRAMS, sizeof *b->slot)) == NULL || (b->seen=calloc(BITMAP_BYTES(NTRIGRAMS), 1)) == NULL)
+	{
+		windex_build_free(b);
+		return NULL;
+	}
+	return b;
+}
+
+static int add_posting(struct posting *p, uint32_t file)
+{
+	uint32_t gap=(p->nfiles == 0) ? file : file - p->last;
+
+	/*A 32-bit gap takes at most 5 bytes*/
+	if(p->size - p->len < 5)
+	{
+		size_t size=p->size ? 2*p->size : 8;
+		unsigned char *t=realloc(p->data, size);
+		if(t == NULL)
+			return -1;
+		p->data=t;
+		p->size=size;
+	}
+	while(gap >= 0x80)
+	{
+		p->data[p->len++]=(unsigned char)(gap | 0x80);
+		gap >>= 7;
+	}
+	p->data[p->len++]=(unsigned char)gap;
+	p->last=file;
+	p->nfiles++;
+	return 0;
+}
+
+/*Returns the postings for trigram t, starting them if need be, or NULL*/
+static struct posting *posting_for(windex_builder_t *b, uint32_t t)
+{
+	if(b->slot[t] == 0)
+	{
+		if(b->nlists == b->alists)
+		{
+			uint32_t n=b->alists ? 2*b->alists : 4096;
+			struct posting *p=reallocarray(b->lists, n, sizeof *p);
+			if(p == NULL)
+				return NULL;
+			b->lists=p;
+			b->alists=n;
+		}
+		memset(&b->lists[b->nlists], 0, sizeof b->lists[0]);
+		b->slot[t]=++b->nlists;
+	}
+	return &b->lists[b->slot[t]-1];
+}
+
+int windex_build_add(windex_builder_t *b, const char *name, const struct wing_stamp *stamp, const char *data, size_t len)
+{
+	struct entry *e;
+	struct posting *p;
+	uint32_t t=0;
+	size_t nfound=0;
+	size_t i;
+
+	if(b->err != 0)
+	{
+		errno=b->err;
+		return -1;
+	}
+	if(b->nfiles == b->afiles)
+	{
+		uint32_t n=b->afiles ? 2*b->afiles : 256;
+		if(b->afiles >= UINT32_MAX/2 || (e=reallocarray(b->files, n, sizeof *e)) == NULL)
+			return -1;
+		b->files=e;
+		b->afiles=n;
+	}
+	e=&b->files[b->nfiles];
+	if((e->name=malloc(strlen(name)+1)) == NULL)
+		return -1;
+	strcpy(e->name, name);
+	e->stamp=*stamp;
+
+	/*Each trigram goes on the list the first time it's seen*/
+	for(i=0; i < len; i++)
+	{
+		t=TRIGRAM(t, data[i]);
+		if(i < 2 || TEST(b->seen, t))
+			continue;
+		SET(b->seen, t);
+		if(nfound == b->afound)
+		{
+			size_t n=b->afound ? 2*b->afound : 65536;
+			uint32_t *f=reallocarray(b->found, n, sizeof *f);
+			if(f == NULL)
+			{
+				b->err=ENOMEM;
+				break;
+			}
+			b->found=f;
+			b->afound=n;
+		}
+		b->found[nfound++]=t;
+	}
+
+	for(i=0; i < nfound; i++)
+	{
+		t=b->found[i];
+		CLEAR(b->seen, t);
+		if(b->err == 0 && ((p=posting_for(b, t)) == NULL || add_posting(p, b->nfiles) != 0))
+			b->err=ENOMEM;
+	}
+	if(b->err != 0)
+	{
+		/*Some of the file's trigrams are missing; the index would lie*/
+		free(e->name);
+		errno=b->err;
+		return -1;
+	}
+	b->nfiles++;
+	return 0;
+}
+
+struct by_name
+{
+	const char *name;
+	uint32_t file;
+};
+
+static int compare_names(const void *va, const void *vb)
+{
+	const struct by_name *a=va, *b=vb;
+	return strcmp(a->name, b->name);
+}
+
+static void pad(FILE *out, uint64_t from, uint64_t to)
+{
+	static const char zeros[8];
+	fwrite(zeros, 1, (size_t)(to - from), out);
+}
+
+/*Returns 0 on success, -1 on error*/
+static int write_index(windex_builder_t *b, FILE *out)
+{
+	struct index_header h;
+	struct index_file f;
+	struct index_trigram tg;
+	struct by_name *order;
+	uint64_t names, offset;
+	uint32_t i, t;
+
+	if((order=reallocarray(NULL, b->nfiles ? b->nfiles : 1, sizeof *order)) == NULL)
+		return -1;
+	for(i=0; i < b->nfiles; i++)
+	{
+		order[i].name=b->files[i].name;
+		order[i].file=i;
+	}
+	qsort(order, b->nfiles, sizeof *order, compare_names);
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, index_magic, sizeof h.magic);
+	h.version=INDEX_VERSION;
+	h.byteorder=BYTE_ORDER_MARK;
+	h.nfiles=b->nfiles;
+	h.ntrigrams=b->nlists;
+	h.files=ALIGN(sizeof h);
+	h.byname=h.files + (uint64_t)b->nfiles * sizeof f;
+	names=h.byname + (uint64_t)b->nfiles * sizeof order->file;
+	offset=names;
+	for(i=0; i < b->nfiles; i++)
+		offset+=strlen(b->files[i].name) + 1;
+	h.trigrams=ALIGN(offset);
+	fwrite(&h, sizeof h, 1, out);
+
+	memset(&f, 0, sizeof f);
+	offset=names;
+	for(i=0; i < b->nfiles; i++)
+	{
+		f.name=offset;
+		f.size=b->files[i].stamp.size;
+		f.mtime=b->files[i].stamp.mtime;
+		fwrite(&f, sizeof f, 1, out);
+		offset+=strlen(b->files[i].name) + 1;
+	}
+	for(i=0; i < b->nfiles; i++)
+		fwrite(&order[i].file, sizeof order[i].file, 1, out);
+	for(i=0; i < b->nfiles; i++)
+		fwrite(b->files[i].name, 1, strlen(b->files[i].name) + 1, out);
+	pad(out, offset, h.trigrams);
+	free(order);
+
+	/*The slots go in trigram order*/
+	memset(&tg, 0, sizeof tg);
+	offset=h.trigrams + (uint64_t)b->nlists * sizeof tg;
+	for(t=0; t < NTRIGRAMS; t++)
+		if(b->slot[t] != 0)
+		{
+			const struct posting *p=&b->lists[b->slot[t]-1];
+			tg.trigram=t;
+			tg.nfiles=p->nfiles;
+			tg.postings=offset;
+			tg.len=p->len;
+			fwrite(&tg, sizeof tg, 1, out);
+			offset+=p->len;
+		}
+	for(t=0; t < NTRIGRAMS; t++)
+		if(b->slot[t] != 0)
+			fwrite(b->lists[b->slot[t]-1].data, 1, b->lists[b->slot[t]-1].len, out);
+
+	return ferror(out) ? -1 : 0;
+}
+
+int windex_build_write(windex_builder_t *b, const char *path)
+{
+	char *tmp;
+	FILE *out;
+	int errno_save=0;
+
+	if(b->err != 0)
+	{
+		errno=b->err;
+		return -1;
+	}
+	if((out=wing_replace_open(path, &tmp)) == NULL)
+		return -1;
+	errno=0;
+	if(write_index(b, out) != 0)
+		errno_save=errno ? errno : EIO;
+	if(fclose(out) != 0 && errno_save == 0)
+		errno_save=errno ? errno : EIO;
+
+	if(errno_save == 0 && wing_replace(tmp, path) != 0)
+		errno_save=errno;
+	if(errno_save != 0)
+		remove(tmp);
+	free(tmp);
+	errno=errno_save;
+	return errno_save == 0 ? 0 : -1;
+}
+
+void windex_build_free(windex_builder_t *b)
+{
+	uint32_t i;
+
+	if(b == NULL)
+		return;
+	for(i=0; i < b->nlists; i++)
+		free(b->lists[i].data);
+	for(i=0; i < b->nfiles; i++)
+		free(b->files[i].name);
+	free(b->lists);
+	free(b->files);
+	free(b->found);
+	free(b->seen);
+	free(b->slot);
+	free(b);
+}
+
+/*Returns nonzero if the mapped file is one we can use*/
+static int use_file(windex_t *ix)
+{
+	const struct index_header *h=(const struct index_header *)ix->map.data;
+	uint64_t len=ix->map.len;
+
+	if(len < sizeof *h)
+		return 0;
+	if(memcmp(h->magic, index_magic, sizeof h->magic) != 0 || h->version != INDEX_VERSION
+		|| h->byteorder != BYTE_ORDER_MARK)
+		return 0;
+	if(h->files % 8 != 0 || h->files > len || (len - h->files) / sizeof *ix->files < h->nfiles)
+		return 0;
+	if(h->byname % 4 != 0 || h->byname > len || (len - h->byname) / sizeof *ix->byname < h->nfiles)
+		return 0;
+	if(h->trigrams % 8 != 0 || h->trigrams > len || (len - h->trigrams) / sizeof *ix->trigrams < h->ntrigrams)
+		return 0;
+	ix->nfiles=h->nfiles;
+	ix->ntrigrams=h->ntrigrams;
+	ix->files=(const struct index_file *)(ix->map.data + h->files);
+	ix->byname=(const uint32_t *)(ix->map.data + h->byname);
+	ix->trigrams=(const struct index_trigram *)(ix->map.data + h->trigrams);
+	return 1;
+}
+
+windex_t *windex_open(const char *path)
+{
+	windex_t *ix;
+	FILE *f;
+	int errno_save;
+
+	if((ix=calloc(1, sizeof *ix)) == NULL)
+		return NULL;
+	if((f=fopen(path, "rb")) == NULL || wing_map(f, &ix->map) != 0)
+	{
+		errno_save=errno;
+		if(f != NULL)
+			fclose(f);
+		free(ix);
+		errno=errno_save;
+		return NULL;
+	}
+	fclose(f);
+	if(!use_file(ix))
+	{
+		windex_close(ix);
+		errno=EINVAL;
+		return NULL;
+	}
+	if((ix->candidates=malloc(BITMAP_BYTES(ix->nfiles) + 1)) == NULL
+		|| (ix->holding=malloc(BITMAP_BYTES(ix->nfiles) + 1)) == NULL)
+	{
+		windex_close(ix);
+		errno=ENOMEM;
+		return NULL;
+	}
+	memset(ix->candidates, 0xff, BITMAP_BYTES(ix->nfiles));
+	return ix;
+}
+
+static const struct index_trigram *find_trigram(const windex_t *ix, uint32_t t)
+{
+	uint32_t lo=0, hi=ix->ntrigrams, mid;
+
+	while(lo < hi)
+	{
+		mid=lo + (hi-lo)/2;
+		if(ix->trigrams[mid].trigram < t)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	if(lo < ix->ntrigrams && ix->trigrams[lo].trigram == t)
+		return &ix->trigrams[lo];
+	return NULL;
+}
+
+/*Sets the bits in ix->holding of the files in tg's postings.
+  Postings that run off the end of the file, or name files that aren't
+    there, say nothing about the files they would have.
+  Returns 0 if the postings are damaged.
+*/
+static int read_postings(windex_t *ix, const struct index_trigram *tg)
+{
+	const unsigned char *p;
+	const unsigned char *end;
+	uint32_t file=0;
+	uint32_t gap;
+	uint32_t n;
+	int shift;
+
+	if(tg->postings > ix->map.len || ix->map.len - tg->postings < tg->len)
+		return 0;
+	p=(const unsigned char *)ix->map.data + tg->postings;
+	end=p + tg->len;
+	memset(ix->holding, 0, BITMAP_BYTES(ix->nfiles));
+	for(n=0; n < tg->nfiles; n++)
+	{
+		gap=0;
+		shift=0;
+		do
+		{
+			if(p == end || shift > 28)
+				return 0;
+			gap|=(uint32_t)(*p & 0x7f) << shift;
+			shift+=7;
+		}
+		while(*p++ & 0x80);
+		file=(n == 0) ? gap : file + gap;
+		if(file >= ix->nfiles)
+			return 0;
+		SET(ix->holding, file);
+	}
+	return 1;
+}
+
+int windex_require(windex_t *ix, const char *lit, size_t len)
+{
+	const struct index_trigram *tg;
+	uint32_t t=0;
+	size_t i, j;
+
+	for(i=0; i < len; i++)
+	{
+		t=TRIGRAM(t, lit[i]);
+		if(i < 2)
+			continue;
+		if((tg=find_trigram(ix, t)) == NULL)
+		{
+			/*In no file at all*/
+			memset(ix->candidates, 0, BITMAP_BYTES(ix->nfiles));
+			return 0;
+		}
+		if(!read_postings(ix, tg))
+			continue;
+		for(j=0; j < BITMAP_BYTES(ix->nfiles); j++)
+			ix->candidates[j]&=ix->holding[j];
+	}
+	return 0;
+}
+
+/*Returns the number of the file named path, or nfiles if it isn't in
+  the index*/
+static uint32_t find_file(const windex_t *ix, const char *path)
+{
+	uint32_t lo=0, hi=ix->nfiles, mid;
+	const struct index_file *f;
+	const char *name;
+	int cmp;
+
+	while(lo < hi)
+	{
+		mid=lo + (hi-lo)/2;
+		if(ix->byname[mid] >= ix->nfiles)
+			return ix->nfiles;
+		f=&ix->files[ix->byname[mid]];
+		if(f->name >= ix->map.len || memchr(ix->map.data + f->name, '\0', ix->map.len - f->name) == NULL)
+			return ix->nfiles;
+		name=ix->map.data + f->name;
+		if((cmp=strcmp(name, path)) == 0)
+			return ix->byname[mid];
+		if(cmp < 0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return ix->nfiles;
+}
+
+int windex_may_match(const windex_t *ix, const char *path)
+{
+	struct wing_stamp st;
+	uint32_t file=find_file(ix, path);
+
+	if(file == ix->nfiles)
+		return 1;
+	if(wing_stamp(path, &st) != 0 || st.size != ix->files[file].size || st.mtime != ix->files[file].mtime)
+		return 1;
+	return TEST(ix->candidates, file) != 0;
+}
+
+void windex_close(windex_t *ix)
+{
+	wing_unmap(&ix->map);
+	free(ix->candidates);
+	free(ix->holding);
+	free(ix);
+}
@@ -0,0 +1,65 @@
+#ifndef H_LIBWING_WINDEX
+#define H_LIBWING_WINDEX
+
+#include <stddef.h>
+
+#include "libwing.h"
+
+/*Trigram indexes of sets of files.
+  For each three-byte sequence, an index lists the files it turns up in,
+    so the files that could hold a literal are found without reading any
+    of them.  That only ever rules files out: anything the index can't
+    vouch for, because it isn't in it or has changed since, might match.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct windex windex_t;
+typedef struct windex_builder windex_builder_t;
+
+/*Starts a new index.
+  Returns NULL if memory runs out.
+*/
+windex_builder_t *windex_build_start(void);
+
+/*Adds the len bytes at data to the index as the file name, which was as
+    stamp describes before it was read.
+  Returns 0 on success, or -1 with errno set.
+*/
+int windex_build_add(windex_builder_t *b, const char *name, const struct wing_stamp *stamp, const char *data, size_t len);
+
+/*Writes the index out to path, replacing whatever is there only once
+    the new one is complete.
+  Returns 0 on success, or -1 with errno set.
+*/
+int windex_build_write(windex_builder_t *b, const char *path);
+
+void windex_build_free(windex_builder_t *b);
+
+/*Opens the index at path.  To start with, every file in it might match.
+  Returns NULL with errno set if it can't be read, or EINVAL if it isn't
+    an index this build can use.
+*/
+windex_t *windex_open(const char *path);
+
+/*Rules out the files that don't hold every trigram of the len bytes at
+    lit.  Literals shorter than three bytes rule nothing out.
+  Returns 0 on success, or -1 if memory runs out.
+*/
+int windex_require(windex_t *ix, const char *lit, size_t len);
+
+/*Returns 0 if the file at path can't hold what windex_require asked for
+    as it was when indexed, and hasn't changed since; otherwise 1.
+  Can be called from several threads at once.
+*/
+int windex_may_match(const windex_t *ix, const char *path);
+
+void windex_close(windex_t *ix);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/*H_LIBWING_WINDEX #include guard*/
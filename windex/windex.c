@@ -0,0 +1,140 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libwing/libwing.h>
+#include <libwing/windex.h>
+
+/*Builds the trigram index that grep -T reads.
+  Files are named in the index as they're named here, so give the same
+    paths grep will see: an index of "src" is no help to a search of
+    "./src".
+*/
+
+const char *myname;
+int error_occurred = 0;
+
+void add_file(windex_builder_t *b, const char *file)
+{
+	struct wing_stamp stamp;
+	struct wing_map map;
+	FILE *in;
+
+	/*Stamped before reading, so a change made while it's read makes
+	  the entry out of date rather than wrong*/
+	if(wing_stamp(file, &stamp) != 0 || (in=fopen(file, "rb")) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		error_occurred = 1;
+		return;
+	}
+	if(wing_map(in, &map) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		error_occurred = 1;
+		fclose(in);
+		return;
+	}
+	fclose(in);
+	if(windex_build_add(b, file, &stamp, map.data, map.len) != 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", myname, file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	wing_unmap(&map);
+}
+
+void add_path(windex_builder_t *b, const char *path, int isdir);
+
+void add_dir(windex_builder_t *b, const char *dir)
+{
+	struct wing_dir *d;
+	size_t dirlen=strlen(dir);
+	const char *name;
+	char *path;
+	int type;
+	int ret;
+
+	if((d=wing_opendir(dir)) == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		error_occurred = 1;
+		return;
+	}
+	/*Don't double up the separator after "dir/"*/
+	if(dirlen > 0 && dir[dirlen-1] == '/')
+		dirlen--;
+	while((ret=wing_readdir(d, &name, &type)) > 0)
+	{
+		size_t len=strlen(name);
+
+		if(type == WING_DT_OTHER)
+			continue;
+		if((path=malloc(dirlen+1+len+1)) == NULL)
+		{
+			fprintf(stderr, "%s: Out of memory\n", myname);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(path, dir, dirlen);
+		path[dirlen]='/';
+		memcpy(path+dirlen+1, name, len+1);
+		add_path(b, path, type == WING_DT_DIR);
+		free(path);
+	}
+	if(ret < 0)
+	{
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		error_occurred = 1;
+	}
+	wing_closedir(d);
+}
+
+void add_path(windex_builder_t *b, const char *path, int isdir)
+{
+	if(isdir)
+		add_dir(b, path);
+	else
+		add_file(b, path);
+}
+
+/*Arguments are told apart by trying to open them as directories*/
+int add_arg(const char *path, void *vb)
+{
+	struct wing_dir *d=wing_opendir(path);
+
+	if(d != NULL)
+		wing_closedir(d);
+	add_path(vb, path, d != NULL);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	windex_builder_t *b;
+	int i;
+
+	myname = argv[0];
+	if(argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <indexfile> <file or directory> ...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if((b=windex_build_start()) == NULL)
+	{
+		fprintf(stderr, "%s: Out of memory\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	for(i=2; i<argc; i++)
+	{
+		if(wing_glob_foreach(argv[i], add_arg, b) == 0)
+			fprintf(stderr, "%s: %s: No such file\n", argv[0], argv[i]);
+	}
+	if(windex_build_write(b, argv[1]) != 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	windex_build_free(b);
+	return error_occurred;
+}